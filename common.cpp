@@ -13,6 +13,8 @@ void SocketRemoteInfo::SetFamily(sa_family_t family)
         family_ = "IPv4";
     } else if (family == AF_INET6) {
         family_ = "IPv6";
+    } else if (family == AF_UNIX) {
+        family_ = "Unix";
     } else {
         family_ = "Others";
     }
@@ -60,6 +62,8 @@ void NetAddress::SetFamilyByJsValue(uint32_t family)
 {
     if (static_cast<Family>(family) == Family::IPv6) {
         family_ = Family::IPv6;
+    } else if (static_cast<Family>(family) == Family::Unix) {
+        family_ = Family::Unix;
     }
 }
 
@@ -67,6 +71,8 @@ void NetAddress::SetFamilyBySaFamily(sa_family_t family)
 {
     if (family == AF_INET6) {
         family_ = Family::IPv6;
+    } else if (family == AF_UNIX) {
+        family_ = Family::Unix;
     }
 }
 
@@ -84,6 +90,8 @@ sa_family_t NetAddress::GetSaFamily() const
 {
     if (family_ == Family::IPv6) {
         return AF_INET6;
+    } else if (family_ == Family::Unix) {
+        return AF_UNIX;
     }
     return AF_INET;
 }
@@ -99,3 +107,45 @@ uint16_t NetAddress::GetPort() const
 }
 
 
+LatencyHistogram::LatencyHistogram() : count_(0), sumNs_(0)
+{
+    for (auto &bucket : buckets_) {
+        bucket = 0;
+    }
+}
+
+void LatencyHistogram::Record(int64_t ns)
+{
+    if (ns < 0) {
+        ns = 0;
+    }
+    int index = (ns == 0) ? 0 : 63 - __builtin_clzll(static_cast<uint64_t>(ns));
+    if (index >= BUCKET_NUM) {
+        index = BUCKET_NUM - 1;
+    }
+    buckets_[index].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sumNs_.fetch_add(static_cast<uint64_t>(ns), std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::GetCount() const
+{
+    return count_.load(std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Dump(const char *name) const
+{
+    uint64_t count = GetCount();
+    if (count == 0) {
+        printf("%s: no samples\n", name);
+        return;
+    }
+    printf("%s: count %lu avg %lu ns\n", name, count, sumNs_.load(std::memory_order_relaxed) / count);
+    for (int i = 0; i < BUCKET_NUM; ++i) {
+        uint64_t n = buckets_[i].load(std::memory_order_relaxed);
+        if (n != 0) {
+            printf("  [%lu, %lu) ns: %lu\n", i == 0 ? 0UL : 1UL << i, 1UL << (i + 1), n);
+        }
+    }
+}
+
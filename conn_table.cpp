@@ -0,0 +1,240 @@
+#include "conn_table.h"
+
+ConnTable::ConnTable(uint32_t capacity)
+    : capacity_(capacity), hot_(new Hot[capacity]), cold_(new Cold[capacity]),
+      sendLocks_(new std::timed_mutex[capacity])
+{
+    for (uint32_t i = 0; i < capacity_; ++i) {
+        hot_[i].generation = 0;
+        hot_[i].denseIndex = 0;
+        hot_[i].recvBytes = 0;
+        hot_[i].sendBytes = 0;
+        hot_[i].sendMessages = 0;
+        hot_[i].sendSyscalls = 0;
+    }
+    dense_.reserve(capacity_);
+}
+
+uint64_t ConnTable::MakeHandle(int fd, uint32_t generation)
+{
+    return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+}
+
+uint64_t ConnTable::Add(int fd, const sockaddr *peer, socklen_t peerLen, ConnOwner owner)
+{
+    if (fd < 0 || static_cast<uint32_t>(fd) >= capacity_) {
+        printf("conn table fd %d out of range\n", fd);
+        return INVALID_HANDLE;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Hot &hot = hot_[fd];
+    uint32_t generation = hot.generation.load(std::memory_order_relaxed);
+    if (generation & 1) {
+        printf("conn table fd %d already live\n", fd);
+        return INVALID_HANDLE;
+    }
+
+    Cold &cold = cold_[fd];
+    (void)memset(&cold.peer, 0, sizeof(cold.peer));
+    cold.peerLen = 0;
+    if (peer != nullptr && peerLen <= sizeof(cold.peer)) {
+        (void)memcpy(&cold.peer, peer, peerLen);
+        cold.peerLen = peerLen;
+    }
+    clock_gettime(CLOCK_REALTIME, &cold.since);
+    cold.owner.store(owner, std::memory_order_relaxed);
+
+    hot.denseIndex = static_cast<uint32_t>(dense_.size());
+    hot.recvBytes.store(0, std::memory_order_relaxed);
+    hot.sendBytes.store(0, std::memory_order_relaxed);
+    hot.sendMessages.store(0, std::memory_order_relaxed);
+    hot.sendSyscalls.store(0, std::memory_order_relaxed);
+    dense_.push_back(fd);
+    hot.generation.store(generation + 1, std::memory_order_release);
+    return MakeHandle(fd, generation + 1);
+}
+
+bool ConnTable::Remove(uint64_t handle)
+{
+    int fd = static_cast<int>(handle & 0xffffffffU);
+    uint32_t generation = static_cast<uint32_t>(handle >> 32);
+    if (fd < 0 || static_cast<uint32_t>(fd) >= capacity_) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Hot &hot = hot_[fd];
+    if (hot.generation.load(std::memory_order_relaxed) != generation || !(generation & 1)) {
+        return false;
+    }
+    uint32_t index = hot.denseIndex;
+    int last = dense_.back();
+    dense_[index] = last;
+    hot_[last].denseIndex = index;
+    dense_.pop_back();
+    hot.generation.store(generation + 1, std::memory_order_release);
+    return true;
+}
+
+bool ConnTable::Close(uint64_t handle)
+{
+    int fd = static_cast<int>(handle & 0xffffffffU);
+    if (fd < 0 || static_cast<uint32_t>(fd) >= capacity_) {
+        return false;
+    }
+    if (IsLive(handle)) {
+        /* a writer stuck on a peer that stopped reading would otherwise hold the send lock forever */
+        (void)shutdown(fd, SHUT_RDWR);
+    }
+    std::lock_guard<std::timed_mutex> sendLock(sendLocks_[fd]);
+    if (!Remove(handle)) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+const ConnTable::Hot *ConnTable::Lookup(uint64_t handle) const
+{
+    int fd = static_cast<int>(handle & 0xffffffffU);
+    uint32_t generation = static_cast<uint32_t>(handle >> 32);
+    if (fd < 0 || static_cast<uint32_t>(fd) >= capacity_ || !(generation & 1)) {
+        return nullptr;
+    }
+    if (hot_[fd].generation.load(std::memory_order_acquire) != generation) {
+        return nullptr;
+    }
+    return &hot_[fd];
+}
+
+uint64_t ConnTable::GetHandle(int fd) const
+{
+    if (fd < 0 || static_cast<uint32_t>(fd) >= capacity_) {
+        return INVALID_HANDLE;
+    }
+    uint32_t generation = hot_[fd].generation.load(std::memory_order_acquire);
+    if (!(generation & 1)) {
+        return INVALID_HANDLE;
+    }
+    return MakeHandle(fd, generation);
+}
+
+int ConnTable::GetFd(uint64_t handle) const
+{
+    if (Lookup(handle) == nullptr) {
+        return -1;
+    }
+    return static_cast<int>(handle & 0xffffffffU);
+}
+
+bool ConnTable::IsLive(uint64_t handle) const
+{
+    return Lookup(handle) != nullptr;
+}
+
+const sockaddr *ConnTable::GetPeerAddr(uint64_t handle) const
+{
+    if (Lookup(handle) == nullptr) {
+        return nullptr;
+    }
+    const Cold &cold = cold_[handle & 0xffffffffU];
+    if (cold.peerLen == 0) {
+        return nullptr;
+    }
+    return reinterpret_cast<const sockaddr *>(&cold.peer);
+}
+
+bool ConnTable::GetSince(uint64_t handle, timespec *since) const
+{
+    if (Lookup(handle) == nullptr) {
+        return false;
+    }
+    *since = cold_[handle & 0xffffffffU].since;
+    return true;
+}
+
+void ConnTable::SetOwner(uint64_t handle, ConnOwner owner)
+{
+    if (Lookup(handle) != nullptr) {
+        cold_[handle & 0xffffffffU].owner.store(owner, std::memory_order_release);
+    }
+}
+
+bool ConnTable::IsOwnedBy(uint64_t handle, ConnOwner owner) const
+{
+    if (Lookup(handle) == nullptr) {
+        return false;
+    }
+    return cold_[handle & 0xffffffffU].owner.load(std::memory_order_acquire) == owner;
+}
+
+bool ConnTable::LockSend(int fd, std::unique_lock<std::timed_mutex> *guard, uint32_t timeoutMs)
+{
+    if (fd < 0 || static_cast<uint32_t>(fd) >= capacity_) {
+        return false;
+    }
+    *guard = std::unique_lock<std::timed_mutex>(sendLocks_[fd], std::defer_lock);
+    if (timeoutMs == 0) {
+        return guard->try_lock();
+    }
+    return guard->try_lock_for(std::chrono::milliseconds(timeoutMs));
+}
+
+void ConnTable::AddRecvBytes(int fd, uint64_t bytes)
+{
+    if (fd >= 0 && static_cast<uint32_t>(fd) < capacity_) {
+        hot_[fd].recvBytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+}
+
+uint64_t ConnTable::AddSendBytes(int fd, uint64_t bytes)
+{
+    if (fd >= 0 && static_cast<uint32_t>(fd) < capacity_) {
+        return hot_[fd].sendBytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    }
+    return 0;
+}
+
+void ConnTable::AddSendCalls(int fd, uint64_t messages, uint64_t syscalls)
+{
+    if (fd >= 0 && static_cast<uint32_t>(fd) < capacity_) {
+        hot_[fd].sendMessages.fetch_add(messages, std::memory_order_relaxed);
+        hot_[fd].sendSyscalls.fetch_add(syscalls, std::memory_order_relaxed);
+    }
+}
+
+uint64_t ConnTable::GetRecvBytes(uint64_t handle) const
+{
+    const Hot *hot = Lookup(handle);
+    return hot == nullptr ? 0 : hot->recvBytes.load(std::memory_order_relaxed);
+}
+
+uint64_t ConnTable::GetSendBytes(uint64_t handle) const
+{
+    const Hot *hot = Lookup(handle);
+    return hot == nullptr ? 0 : hot->sendBytes.load(std::memory_order_relaxed);
+}
+
+uint64_t ConnTable::GetSendMessages(uint64_t handle) const
+{
+    const Hot *hot = Lookup(handle);
+    return hot == nullptr ? 0 : hot->sendMessages.load(std::memory_order_relaxed);
+}
+
+uint64_t ConnTable::GetSendSyscalls(uint64_t handle) const
+{
+    const Hot *hot = Lookup(handle);
+    return hot == nullptr ? 0 : hot->sendSyscalls.load(std::memory_order_relaxed);
+}
+
+uint32_t ConnTable::GetCapacity() const
+{
+    return capacity_;
+}
+
+size_t ConnTable::GetSize() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dense_.size();
+}
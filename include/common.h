@@ -1,16 +1,31 @@
+#ifndef COMMON_H
+#define COMMON_H
+
 #include <arpa/inet.h>
 #include <cerrno>
 #include <fcntl.h>
 #include <memory>
 #include <netinet/tcp.h>
+#include <net/if.h>
 #include <poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <thread>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <string.h>
 #include <list>
+#include <sched.h>
+#include <string>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <time.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 
 typedef int                     int32_t;
 typedef long int                int64_t;
@@ -57,6 +72,7 @@ public:
     enum class Family : uint32_t {
         IPv4 = 1,
         IPv6 = 2,
+        Unix = 3, /* address is a filesystem path, or an abstract name when it starts with '@' */
     };
 
     NetAddress();
@@ -87,3 +103,28 @@ private:
     uint16_t port_;
 };
 
+
+class LatencyHistogram final {
+public:
+    static constexpr const int BUCKET_NUM = 32; /* bucket i holds samples in [2^i, 2^(i+1)) ns */
+
+    LatencyHistogram();
+
+    ~LatencyHistogram() = default;
+
+    void Record(int64_t ns);
+
+    uint64_t GetCount() const;
+
+    void Dump(const char *name) const;
+
+private:
+    std::atomic<uint64_t> buckets_[BUCKET_NUM];
+
+    std::atomic<uint64_t> count_;
+
+    std::atomic<uint64_t> sumNs_;
+};
+
+#endif // COMMON_H
+
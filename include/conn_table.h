@@ -0,0 +1,144 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include "common.h"
+#include <mutex>
+#include <vector>
+
+/* who reads and writes a connection; broadcast only reaches EXEC connections */
+enum class ConnOwner : uint32_t {
+    EXEC = 0,  /* ExecTcpListen / ExecConnect connections, written with ExecTcpSend */
+    RELAY = 1, /* spliced by the relay: injected bytes would corrupt the proxied stream */
+    RPC = 2,   /* framed by the RPC layer */
+};
+
+/*
+ * Connection table indexed by fd. A handle packs the fd with the slot generation at the time the
+ * connection was added, so a handle to a closed connection never matches a later connection that
+ * reuses the same fd number. Generations are odd while a slot is live.
+ */
+class ConnTable final {
+public:
+    static constexpr const uint64_t INVALID_HANDLE = 0;
+
+    explicit ConnTable(uint32_t capacity);
+
+    ~ConnTable() = default;
+
+    uint64_t Add(int fd, const sockaddr *peer, socklen_t peerLen, ConnOwner owner = ConnOwner::EXEC);
+
+    /* false when handle was not live */
+    bool Remove(uint64_t handle);
+
+    /*
+     * Removes a live connection and closes its fd while holding the fd's send lock. A writer holding
+     * that lock therefore only needs IsLive(handle) to know the fd is still open and still this
+     * connection's. Writers blocked on the fd are woken by shutting it down first. Only the
+     * connection's owner may call it. False, and nothing is closed, when handle was not live.
+     */
+    bool Close(uint64_t handle);
+
+    uint64_t GetHandle(int fd) const;
+
+    int GetFd(uint64_t handle) const;
+
+    bool IsLive(uint64_t handle) const;
+
+    /* only stable while the connection is live; its receive thread may read it without locking */
+    const sockaddr *GetPeerAddr(uint64_t handle) const;
+
+    /* CLOCK_REALTIME when the connection was added; false for a stale handle */
+    bool GetSince(uint64_t handle, timespec *since) const;
+
+    /* for connections made through ExecConnectOnly and then handed to a relay or RPC client */
+    void SetOwner(uint64_t handle, ConnOwner owner);
+
+    bool IsOwnedBy(uint64_t handle, ConnOwner owner) const;
+
+    /*
+     * Every writer of a tracked connection (ExecTcpSend, cork flushes, broadcast) holds its send lock
+     * for a whole message, so messages from different threads never interleave on the stream.
+     * timeoutMs 0 only tries once.
+     */
+    bool LockSend(int fd, std::unique_lock<std::timed_mutex> *guard, uint32_t timeoutMs);
+
+    void AddRecvBytes(int fd, uint64_t bytes);
+
+    /* bytes accepted by the kernel, counted per write by every writer; returns the connection's new total */
+    uint64_t AddSendBytes(int fd, uint64_t bytes);
+
+    /* messages handed to the send path and the write syscalls it took for them */
+    void AddSendCalls(int fd, uint64_t messages, uint64_t syscalls);
+
+    uint64_t GetRecvBytes(uint64_t handle) const;
+
+    uint64_t GetSendBytes(uint64_t handle) const;
+
+    uint64_t GetSendMessages(uint64_t handle) const;
+
+    uint64_t GetSendSyscalls(uint64_t handle) const;
+
+    uint32_t GetCapacity() const;
+
+    size_t GetSize() const;
+
+    /*
+     * fn(fd) is called with the table locked if handle is still live. Connections are removed before
+     * their fd is closed, so the fd cannot be closed and reused by another connection while fn runs.
+     */
+    template <typename Fn> bool WithLiveFd(uint64_t handle, Fn fn) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (Lookup(handle) == nullptr) {
+            return false;
+        }
+        fn(static_cast<int>(handle & 0xffffffffU));
+        return true;
+    }
+
+    /* fn(handle, fd) is called for every live connection with the table locked */
+    template <typename Fn> void ForEach(Fn fn) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int fd : dense_) {
+            fn(MakeHandle(fd, hot_[fd].generation.load(std::memory_order_relaxed)), fd);
+        }
+    }
+
+private:
+    /* touched on every message: kept small and contiguous */
+    struct Hot {
+        std::atomic<uint32_t> generation;
+        uint32_t denseIndex;
+        std::atomic<uint64_t> recvBytes;
+        std::atomic<uint64_t> sendBytes;
+        std::atomic<uint64_t> sendMessages;
+        std::atomic<uint64_t> sendSyscalls;
+    };
+
+    /* written when the connection is added */
+    struct Cold {
+        sockaddr_storage peer;
+        socklen_t peerLen;
+        timespec since;
+        std::atomic<ConnOwner> owner;
+    };
+
+    static uint64_t MakeHandle(int fd, uint32_t generation);
+
+    const Hot *Lookup(uint64_t handle) const;
+
+    uint32_t capacity_;
+
+    std::unique_ptr<Hot[]> hot_;
+
+    std::unique_ptr<Cold[]> cold_;
+
+    std::unique_ptr<std::timed_mutex[]> sendLocks_;
+
+    std::vector<int> dense_;
+
+    mutable std::mutex mutex_;
+};
+
+#endif // CONN_TABLE_H
@@ -0,0 +1,90 @@
+#ifndef RPC_CHANNEL_H
+#define RPC_CHANNEL_H
+
+#include "common.h"
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+enum class RpcStatus : uint32_t {
+    OK = 0,
+    TIMEOUT = 1,
+    CLOSED = 2,
+};
+
+struct RpcResult {
+    RpcStatus status;
+    std::string body;
+};
+
+using RpcCallback = std::function<void(const RpcResult &result)>;
+
+/* may be called from any thread, once, at any time after the handler returns */
+using RpcReply = std::function<void(const std::string &response)>;
+
+using RpcHandler = std::function<void(const std::string &request, const RpcReply &reply)>;
+
+/*
+ * Pipelined request/response over one TCP connection. Every frame carries a correlation id, so any
+ * number of calls may be in flight and responses are matched to them in whatever order they arrive.
+ */
+class RpcClient final {
+public:
+    RpcClient();
+
+    ~RpcClient();
+
+    bool Connect(NetAddress *address, uint32_t timeoutSec);
+
+    /*
+     * callback runs exactly once, on the client's reader thread or, when sending fails, on the caller's
+     * thread with RpcStatus::CLOSED; false means the request was not sent. A failed send drops the
+     * connection, since part of the frame may be out: every call in flight completes with CLOSED and
+     * Connect re-establishes it.
+     */
+    bool Call(const std::string &request, uint32_t timeoutMs, RpcCallback callback);
+
+    std::future<RpcResult> Call(const std::string &request, uint32_t timeoutMs);
+
+    size_t GetInFlight() const;
+
+    void Close();
+
+private:
+    struct Pending {
+        RpcCallback callback;
+        int64_t deadlineNs;
+    };
+
+    using Deadline = std::pair<int64_t, uint64_t>;
+
+    void ReadLoop();
+
+    void ExpireDeadlines(int64_t nowNs);
+
+    void FailAll(RpcStatus status);
+
+    int sock_;
+
+    std::atomic<uint64_t> nextId_;
+
+    std::atomic<bool> closed_;
+
+    mutable std::mutex mutex_;
+
+    std::unordered_map<uint64_t, Pending> pending_;
+
+    std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> deadlines_;
+
+    std::mutex sendMutex_;
+
+    std::thread reader_;
+};
+
+/* serves handler on every connection accepted on sockfd */
+bool ExecRpcListen(int sockfd, RpcHandler handler);
+
+#endif // RPC_CHANNEL_H
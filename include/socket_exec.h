@@ -1,5 +1,70 @@
+#ifndef SOCKET_EXEC_H
+#define SOCKET_EXEC_H
+
 
 #include "common.h"
+#include "conn_table.h"
+#include "tcp_broadcast.h"
+#include "tcp_relay.h"
+#include "udp_multicast.h"
+#include "rpc_channel.h"
+#include "traffic_capture.h"
+#include "tcp_cork.h"
+
+enum class ThreadPlacement : uint32_t {
+    NONE = 0,         /* let the scheduler float I/O threads across all cores */
+    ROUND_ROBIN = 1,  /* pin each I/O thread to the next allowed core */
+    INCOMING_CPU = 2, /* pin to the core the socket's packets arrive on (SO_INCOMING_CPU) */
+};
+
+/* I/O threads are placed on the cores the calling thread may run on at the time of this call */
+void SetThreadPlacement(ThreadPlacement placement);
+
+enum TimestampFlag : uint32_t {
+    TIMESTAMP_RX_SOFTWARE = 1 << 0,
+    TIMESTAMP_RX_HARDWARE = 1 << 1, /* needs a NIC with hardware timestamping enabled */
+    TIMESTAMP_TX_SOFTWARE = 1 << 2,
+};
+
+/* applies to sockets bound, connected or accepted after the call; flags is a mask of TimestampFlag */
+void SetTimestamping(uint32_t flags);
+
+void DumpLatencyHistograms();
+
+struct RecvTimestamp {
+    timespec software; /* kernel RX time, CLOCK_REALTIME, zero when unavailable */
+    timespec hardware; /* NIC RX time in the NIC clock, zero when unavailable */
+    timespec user;     /* when recvmsg returned, CLOCK_REALTIME */
+};
+
+/*
+ * Receives every message read by the library's receive threads. The handler owns data: it must free()
+ * it and call ExecConsumeRecvData(sock, len) once processed, possibly later on another thread. ts is
+ * filled according to SetTimestamping. Set it before any socket is bound or connected.
+ */
+using RecvMessageHandler = std::function<void(int sock, void *data, size_t len, const SocketRemoteInfo &info,
+                                              const RecvTimestamp &ts)>;
+
+void SetRecvMessageHandler(RecvMessageHandler handler);
+
+enum class UdpDropPolicy : uint32_t {
+    PAUSE_READ = 0, /* stop reading; the kernel drops what overflows the socket buffer */
+    DISCARD = 1,    /* keep reading and discard, so consumers resume on fresh datagrams */
+};
+
+/*
+ * Bounds bytes handed to message callbacks but not yet consumed, per socket and in total. A socket
+ * over a high watermark stops being read (TCP then pushes back on the sender) until both its own
+ * and the global count are at or below the low watermarks. 0 disables a limit.
+ */
+void SetRecvFlowControl(uint64_t connHigh, uint64_t connLow, uint64_t globalHigh, uint64_t globalLow);
+
+void SetUdpDropPolicy(UdpDropPolicy policy);
+
+/* credits len bytes of a message handed to the RecvMessageHandler back to flow control */
+void ExecConsumeRecvData(int sockfd, size_t len);
+
+void DumpRecvFlowStats();
 
 int MakeTcpSocket(sa_family_t family);
 
@@ -9,11 +74,39 @@ bool ExecUdpBind(int sockfd, NetAddress *address);
 
 bool ExecUdpSend(int sockfd, NetAddress *address, std::string send_str, socklen_t size);
 
+/* source is empty for any-source membership; ifIndex 0 lets the kernel pick the interface */
+bool ExecUdpJoinGroup(int sockfd, NetAddress *group, const std::string &source, uint32_t ifIndex);
+
+bool ExecUdpLeaveGroup(int sockfd, NetAddress *group, const std::string &source, uint32_t ifIndex);
+
+/*
+ * binds to the group address and port, shared with other local subscribers, then joins; a subscriber
+ * that binds a wildcard address itself must set SO_REUSEADDR before ExecUdpBind
+ */
+bool ExecUdpSubscribe(int sockfd, NetAddress *group, const std::string &source, uint32_t ifIndex);
+
+/* family selects IP_MULTICAST_* or IPV6_MULTICAST_*; ttl is the hop limit for IPv6 */
+bool ExecUdpSetMulticast(int sockfd, sa_family_t family, bool loop, int ttl, uint32_t ifIndex);
+
+/* one send to the group, prefixed with a MulticastHeader sequence number */
+bool ExecUdpPublish(int sockfd, NetAddress *group, const std::string &payload);
+
 bool ExecTcpBind(int sockfd, NetAddress *address);
 
 bool ExecConnect(int sockfd, NetAddress *address, uint32_t timeoutSec);
 
+/* like ExecConnect but starts no receive thread and enables no timestamping: the caller owns reading */
+bool ExecConnectOnly(int sockfd, NetAddress *address, uint32_t timeoutSec);
+
 bool ExecTcpSend(int sockfd, std::string send_str, socklen_t size);
 
 bool ExecTcpListen(int sockfd);
 
+/* accepted and connected TCP sockets, live until their receive thread sees the peer close */
+ConnTable &GetConnTable();
+
+/* shuts the connection down; its receive thread then closes the fd and releases the slot */
+bool ExecCloseConn(uint64_t handle);
+
+#endif // SOCKET_EXEC_H
+
@@ -0,0 +1,17 @@
+#ifndef TCP_BROADCAST_H
+#define TCP_BROADCAST_H
+
+#include "common.h"
+#include <vector>
+
+/* immutable payload shared by every connection it is queued on; freed after the last send completes */
+using SharedPayload = std::shared_ptr<const std::string>;
+
+SharedPayload MakeSharedPayload(std::string data);
+
+/* queues payload on each live handle without copying it; stale handles are skipped */
+bool ExecTcpBroadcast(const SharedPayload &payload, const std::vector<uint64_t> &handles);
+
+bool ExecTcpBroadcastAll(const SharedPayload &payload);
+
+#endif // TCP_BROADCAST_H
@@ -0,0 +1,27 @@
+#ifndef TCP_CORK_H
+#define TCP_CORK_H
+
+#include "common.h"
+
+/*
+ * Cork mode for a connected TCP socket: ExecTcpSend appends to a per-connection buffer that is sent
+ * as one write once it reaches flushBytes, once flushDelayUs has passed since the first unsent byte,
+ * or on ExecTcpFlush. flushDelayUs 0 disables the deadline; flushBytes 0 turns cork mode off after
+ * flushing what is buffered. The deadline flush never blocks; if it cannot send everything, the rest
+ * stays buffered and is retried. Once a flush loses data, later ExecTcpSend and ExecTcpFlush calls on
+ * the connection fail.
+ */
+bool ExecTcpSetCork(int sockfd, size_t flushBytes, uint32_t flushDelayUs);
+
+bool ExecTcpFlush(int sockfd);
+
+/* messages, send syscalls and data segments (from TCP_INFO) of any tracked connection, plus cork state */
+void DumpTcpWriteStats(int sockfd);
+
+/* used by ExecTcpSend: returns false when sockfd is not corked and must be sent directly */
+bool TcpCorkWrite(int sockfd, const char *data, size_t size, bool *sent);
+
+/* used by broadcast before it writes: never blocks, true once nothing corked is left ahead of it */
+bool TcpCorkDrain(int sockfd);
+
+#endif // TCP_CORK_H
@@ -0,0 +1,14 @@
+#ifndef TCP_RELAY_H
+#define TCP_RELAY_H
+
+#include "common.h"
+
+/*
+ * Listens on sockfd and pairs every accepted connection with a new connection to backend. Bytes are
+ * moved between the two with splice() through a pipe per direction and never enter user space.
+ */
+bool ExecTcpRelayListen(int sockfd, NetAddress *backend, uint32_t timeoutSec);
+
+void DumpRelayStats();
+
+#endif // TCP_RELAY_H
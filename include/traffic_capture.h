@@ -0,0 +1,76 @@
+#ifndef TRAFFIC_CAPTURE_H
+#define TRAFFIC_CAPTURE_H
+
+#include "common.h"
+
+/*
+ * Capture file layout: a CaptureFileHeader, an index of CaptureIndexEntry (one per CAPTURE_INDEX_STRIDE
+ * bytes of records), then 8-byte aligned records. A record is a CaptureRecordHeader followed by its
+ * payload; a zero length marks the end of what has been committed so far.
+ */
+static constexpr const uint64_t CAPTURE_MAGIC = 0x3250414358454b53; /* "SKEXCAP2" */
+
+static constexpr const uint64_t CAPTURE_INDEX_STRIDE = 1024 * 1024;
+
+struct CaptureFileHeader {
+    uint64_t magic;
+    uint64_t capacity;    /* bytes available for records */
+    uint64_t indexOffset;
+    uint64_t indexCount;
+    uint64_t dataOffset;
+};
+
+struct CaptureIndexEntry {
+    int64_t timestampNs; /* first record starting in this stride, 0 if none */
+    uint64_t offset;     /* relative to dataOffset */
+};
+
+struct CaptureRecordHeader {
+    uint32_t length;     /* whole record including this header and padding; written last */
+    uint32_t payloadLen;
+    int64_t timestampNs; /* CLOCK_REALTIME */
+    uint16_t family;
+    uint16_t port;
+    uint8_t isTcp;
+    uint8_t reserved[3];
+    uint8_t address[16]; /* AF_UNIX: leading bytes of sun_path, abstract names keep their NUL */
+    uint64_t connId;     /* conn table handle for TCP, so replay can keep each stream apart; 0 for UDP */
+};
+
+bool StartCapture(const std::string &path, uint64_t capacity);
+
+void StopCapture();
+
+bool IsCaptureEnabled();
+
+/* appends one received message; lock-free, drops and counts the message when the file is full */
+void CaptureMessage(bool isTcp, uint64_t connId, const sockaddr *remote, const void *data, size_t len,
+                    const timespec &when);
+
+uint64_t GetCaptureDropped();
+
+class CaptureReader final {
+public:
+    CaptureReader();
+
+    ~CaptureReader();
+
+    bool Open(const std::string &path);
+
+    /* first record at or after timestampNs, found through the index */
+    bool Seek(int64_t timestampNs);
+
+    /* payload points into the mapping and stays valid until the reader is destroyed */
+    bool Next(CaptureRecordHeader *header, const char **payload);
+
+private:
+    const char *base_;
+
+    size_t size_;
+
+    const CaptureFileHeader *header_;
+
+    uint64_t cursor_;
+};
+
+#endif // TRAFFIC_CAPTURE_H
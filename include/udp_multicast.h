@@ -0,0 +1,49 @@
+#ifndef UDP_MULTICAST_H
+#define UDP_MULTICAST_H
+
+#include "common.h"
+
+/* prepended by ExecUdpPublish so subscribers can count per-group receives and detect loss */
+struct MulticastHeader {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t seq;
+} __attribute__((packed));
+
+static constexpr const uint32_t MULTICAST_MAGIC = 0x534d4331; /* "SMC1" */
+
+/* a group or sender address in binary, so the receive path can key on it without formatting */
+struct MulticastAddr {
+    uint64_t words[2]; /* in_addr in the first 4 bytes, or in6_addr */
+    uint16_t port;
+    uint16_t family;
+
+    bool operator==(const MulticastAddr &other) const
+    {
+        return words[0] == other.words[0] && words[1] == other.words[1] && port == other.port &&
+               family == other.family;
+    }
+};
+
+/* counters of one subscribing socket; created and used by its receive thread only */
+struct MulticastSocketStats;
+
+/*
+ * fills header with the next sequence number of sock's publications. Subscribers follow each sender
+ * address and port, so a socket that publishes to several groups shows gaps in each: use one per group.
+ */
+void MakeMulticastHeader(int sock, MulticastHeader *header);
+
+/* registers sock's counters with DumpMulticastStats; the receive thread keeps the result */
+std::shared_ptr<MulticastSocketStats> AttachMulticastStats(int sock);
+
+/*
+ * accounts one datagram received on group; returns the header length the caller should strip.
+ * Sequences are tracked per subscribing socket and sender, so local subscribers do not see each other's copies.
+ */
+size_t OnMulticastMessage(MulticastSocketStats *stats, const MulticastAddr &group, const sockaddr *sender,
+                          const char *data, size_t len);
+
+void DumpMulticastStats();
+
+#endif // UDP_MULTICAST_H
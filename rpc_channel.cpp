@@ -0,0 +1,362 @@
+#include "socket_exec.h"
+#include <endian.h>
+
+static constexpr const int RPC_POLL_TIMEOUT = 10; // ms, also the deadline resolution
+
+static constexpr const uint32_t RPC_MAX_BODY = 16 * 1024 * 1024;
+
+static constexpr const size_t RPC_READ_SIZE = 65536;
+
+enum RpcFrameType : uint32_t {
+    RPC_REQUEST = 1,
+    RPC_RESPONSE = 2,
+};
+
+struct RpcFrameHeader {
+    uint32_t length; /* body bytes following the header */
+    uint32_t type;
+    uint64_t corrId;
+} __attribute__((packed));
+
+struct RpcServerConn {
+    int sock;
+    uint64_t handle;
+    std::mutex sendMutex;
+};
+
+static int64_t MonotonicNs()
+{
+    timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000L + now.tv_nsec;
+}
+
+static std::string MakeFrame(RpcFrameType type, uint64_t corrId, const std::string &body)
+{
+    RpcFrameHeader header;
+    header.length = htonl(static_cast<uint32_t>(body.size()));
+    header.type = htonl(type);
+    header.corrId = htobe64(corrId);
+    std::string frame;
+    frame.reserve(sizeof(header) + body.size());
+    frame.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    frame.append(body);
+    return frame;
+}
+
+/* reads what is available and hands every complete frame to onFrame; false once the peer is gone */
+template <typename Fn>
+static bool ReadFrames(int sock, std::string *pending, Fn onFrame)
+{
+    char buf[RPC_READ_SIZE];
+    while (true) {
+        auto len = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len == 0) {
+            return false;
+        }
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+            printf("rpc recv failed %s\n", strerror(errno));
+            return false;
+        }
+        GetConnTable().AddRecvBytes(sock, len);
+        pending->append(buf, len);
+    }
+
+    size_t pos = 0;
+    while (pending->size() - pos >= sizeof(RpcFrameHeader)) {
+        RpcFrameHeader header;
+        (void)memcpy(&header, pending->data() + pos, sizeof(header));
+        uint32_t length = ntohl(header.length);
+        if (length > RPC_MAX_BODY) {
+            printf("rpc frame too large %u\n", length);
+            return false;
+        }
+        if (pending->size() - pos - sizeof(header) < length) {
+            break;
+        }
+        onFrame(ntohl(header.type), be64toh(header.corrId), pending->substr(pos + sizeof(header), length));
+        pos += sizeof(header) + length;
+    }
+    pending->erase(0, pos);
+    return true;
+}
+
+RpcClient::RpcClient() : sock_(-1), nextId_(1), closed_(true) {}
+
+RpcClient::~RpcClient()
+{
+    Close();
+}
+
+bool RpcClient::Connect(NetAddress *address, uint32_t timeoutSec)
+{
+    if (!closed_) {
+        printf("rpc client already connected\n");
+        return false;
+    }
+    /* the reader of a dropped connection sets closed_ before it fails the calls left behind */
+    if (reader_.joinable()) {
+        reader_.join();
+    }
+    int sock = MakeTcpSocket(address->GetSaFamily());
+    if (sock < 0) {
+        return false;
+    }
+    if (address->GetSaFamily() != AF_UNIX) {
+        int one = 1;
+        (void)setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (!ExecConnectOnly(sock, address, timeoutSec)) {
+        close(sock);
+        return false;
+    }
+    GetConnTable().SetOwner(GetConnTable().GetHandle(sock), ConnOwner::RPC);
+    sock_ = sock;
+    closed_ = false;
+    reader_ = std::thread(&RpcClient::ReadLoop, this);
+    return true;
+}
+
+bool RpcClient::Call(const std::string &request, uint32_t timeoutMs, RpcCallback callback)
+{
+    if (closed_) {
+        callback({RpcStatus::CLOSED, {}});
+        return false;
+    }
+    uint64_t corrId = nextId_++;
+    int64_t deadline = MonotonicNs() + static_cast<int64_t>(timeoutMs) * 1000000L;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.emplace(corrId, Pending{std::move(callback), deadline});
+        deadlines_.emplace(deadline, corrId);
+    }
+
+    std::string frame = MakeFrame(RPC_REQUEST, corrId, request);
+    bool sent = false;
+    {
+        std::lock_guard<std::mutex> lock(sendMutex_);
+        sent = !closed_ && ExecTcpSend(sock_, std::move(frame), sizeof(RpcFrameHeader) + request.size());
+        if (!sent && sock_ >= 0) {
+            /* part of the frame may be out: drop the connection rather than misframe everything after it */
+            (void)shutdown(sock_, SHUT_RDWR);
+        }
+    }
+    if (!sent) {
+        /* whoever erases the entry completes the call: the reader may have failed it already */
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = pending_.find(corrId);
+            if (it == pending_.end()) {
+                return false;
+            }
+            callback = std::move(it->second.callback);
+            pending_.erase(it);
+        }
+        callback({RpcStatus::CLOSED, {}});
+        return false;
+    }
+    return true;
+}
+
+std::future<RpcResult> RpcClient::Call(const std::string &request, uint32_t timeoutMs)
+{
+    auto promise = std::make_shared<std::promise<RpcResult>>();
+    std::future<RpcResult> future = promise->get_future();
+    (void)Call(request, timeoutMs, [promise](const RpcResult &result) { promise->set_value(result); });
+    return future;
+}
+
+size_t RpcClient::GetInFlight() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_.size();
+}
+
+void RpcClient::Close()
+{
+    {
+        /* the reader closes sock_ under sendMutex_, so the fd cannot be reused under this shutdown */
+        std::lock_guard<std::mutex> lock(sendMutex_);
+        if (sock_ >= 0) {
+            (void)shutdown(sock_, SHUT_RDWR);
+        }
+    }
+    if (reader_.joinable()) {
+        reader_.join();
+    }
+}
+
+void RpcClient::ExpireDeadlines(int64_t nowNs)
+{
+    std::vector<RpcCallback> expired;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (!deadlines_.empty() && deadlines_.top().first <= nowNs) {
+            auto it = pending_.find(deadlines_.top().second);
+            deadlines_.pop();
+            /* answered calls leave their deadline behind; it is simply skipped here */
+            if (it != pending_.end()) {
+                expired.push_back(std::move(it->second.callback));
+                pending_.erase(it);
+            }
+        }
+    }
+    for (auto &callback : expired) {
+        callback({RpcStatus::TIMEOUT, {}});
+    }
+}
+
+void RpcClient::FailAll(RpcStatus status)
+{
+    std::unordered_map<uint64_t, Pending> failed;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        failed.swap(pending_);
+        deadlines_ = decltype(deadlines_)();
+    }
+    for (auto &entry : failed) {
+        entry.second.callback({status, {}});
+    }
+}
+
+void RpcClient::ReadLoop()
+{
+    std::string buffer;
+    pollfd fds[1] = {{0}};
+    fds[0].fd = sock_;
+    fds[0].events = POLLIN;
+
+    auto onFrame = [this](uint32_t type, uint64_t corrId, std::string body) {
+        if (type != RPC_RESPONSE) {
+            return;
+        }
+        RpcCallback callback;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = pending_.find(corrId);
+            if (it == pending_.end()) {
+                return; /* already timed out */
+            }
+            callback = std::move(it->second.callback);
+            pending_.erase(it);
+        }
+        callback({RpcStatus::OK, std::move(body)});
+    };
+
+    while (true) {
+        int ret = poll(fds, 1, RPC_POLL_TIMEOUT);
+        if (ret < 0 && errno != EINTR) {
+            printf("poll to rpc recv failed %s\n", strerror(errno));
+            break;
+        }
+        if (ret > 0 && !ReadFrames(sock_, &buffer, onFrame)) {
+            break;
+        }
+        ExpireDeadlines(MonotonicNs());
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sendMutex_);
+        closed_ = true;
+        if (!GetConnTable().Close(GetConnTable().GetHandle(sock_))) {
+            close(sock_);
+        }
+        sock_ = -1;
+    }
+    FailAll(RpcStatus::CLOSED);
+}
+
+static void RpcServeConn(int connfd, sockaddr_storage peer, socklen_t peerLen, RpcHandler handler)
+{
+    auto conn = std::make_shared<RpcServerConn>();
+    conn->sock = connfd;
+    conn->handle = GetConnTable().Add(connfd, reinterpret_cast<sockaddr *>(&peer), peerLen, ConnOwner::RPC);
+    if (conn->handle == ConnTable::INVALID_HANDLE) {
+        close(connfd);
+        return;
+    }
+
+    std::string buffer;
+    pollfd fds[1] = {{0}};
+    fds[0].fd = connfd;
+    fds[0].events = POLLIN;
+
+    auto onFrame = [&conn, &handler](uint32_t type, uint64_t corrId, std::string body) {
+        if (type != RPC_REQUEST) {
+            return;
+        }
+        std::weak_ptr<RpcServerConn> weakConn = conn;
+        handler(body, [weakConn, corrId](const std::string &response) {
+            auto target = weakConn.lock();
+            if (target == nullptr) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(target->sendMutex);
+            if (!GetConnTable().IsLive(target->handle)) {
+                return;
+            }
+            if (!ExecTcpSend(target->sock, MakeFrame(RPC_RESPONSE, corrId, response),
+                             sizeof(RpcFrameHeader) + response.size())) {
+                (void)shutdown(target->sock, SHUT_RDWR); /* a torn response would misframe the rest */
+            }
+        });
+    };
+
+    while (true) {
+        int ret = poll(fds, 1, -1);
+        if (ret < 0 && errno != EINTR) {
+            printf("poll to rpc serve failed %s\n", strerror(errno));
+            break;
+        }
+        if (ret > 0 && !ReadFrames(connfd, &buffer, onFrame)) {
+            break;
+        }
+    }
+
+    {
+        /* no reply may be mid-send on this fd once it is released */
+        std::lock_guard<std::mutex> lock(conn->sendMutex);
+        if (!GetConnTable().Close(conn->handle)) {
+            close(connfd);
+        }
+    }
+}
+
+static void RpcListenConn(int socketFd, RpcHandler handler)
+{
+    while (true) {
+        sockaddr_storage peer = {0};
+        socklen_t peerLen = sizeof(peer);
+        int connfd = accept4(socketFd, reinterpret_cast<sockaddr *>(&peer), &peerLen, SOCK_NONBLOCK);
+        if (connfd == -1) {
+            if (errno == EWOULDBLOCK) {
+                sleep(1);
+                continue;
+            }
+            printf("error when accepting rpc connection errno %d %s\n", errno, strerror(errno));
+            return;
+        }
+        if (peer.ss_family != AF_UNIX) {
+            int one = 1;
+            (void)setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        std::thread serviceThread(RpcServeConn, connfd, peer, peerLen, handler);
+        serviceThread.detach();
+    }
+}
+
+bool ExecRpcListen(int sockfd, RpcHandler handler)
+{
+    printf("rpc server start listen.\n");
+    if (listen(sockfd, 128) < 0) {
+        printf("listen errno %d %s\n", errno, strerror(errno));
+        return false;
+    }
+
+    std::thread serviceThread(RpcListenConn, sockfd, std::move(handler));
+    serviceThread.detach();
+    return true;
+}
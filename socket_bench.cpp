@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "socket_exec.h"
+
+static constexpr const int BENCH_MSG_SIZE = 64;
+
+static std::string TCP_IP = "127.0.0.1";
+static uint16_t TCP_PORT = 17777;
+static std::string UDS_NAME = "@socket_exec_bench";
+
+static bool ReadFull(int sock, char *buf, size_t size)
+{
+    pollfd fds[1] = {{0}};
+    fds[0].fd = sock;
+    fds[0].events = POLLIN;
+    size_t done = 0;
+    while (done < size) {
+        auto len = read(sock, buf + done, size - done);
+        if (len > 0) {
+            done += len;
+            continue;
+        }
+        if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+            return false;
+        }
+        (void)poll(fds, 1, -1);
+    }
+    return true;
+}
+
+static void EchoServer(int listenFd)
+{
+    int connfd = accept(listenFd, NULL, NULL);
+    while (connfd < 0 && errno == EAGAIN) {
+        pollfd fds[1] = {{listenFd, POLLIN, 0}};
+        (void)poll(fds, 1, -1);
+        connfd = accept(listenFd, NULL, NULL);
+    }
+    if (connfd < 0) {
+        printf("bench accept failed %s\n", strerror(errno));
+        return;
+    }
+    char buf[BENCH_MSG_SIZE];
+    while (ReadFull(connfd, buf, sizeof(buf))) {
+        if (write(connfd, buf, sizeof(buf)) != sizeof(buf)) {
+            break;
+        }
+    }
+    close(connfd);
+}
+
+/* ping-pong over the library send path; the echo side uses plain read/write */
+static void RunPingPong(const char *name, NetAddress *address, int rounds)
+{
+    int srv = MakeTcpSocket(address->GetSaFamily());
+    int one = 1;
+    (void)setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (!ExecTcpBind(srv, address) || listen(srv, 10) < 0) {
+        printf("%s: bench listen failed\n", name);
+        return;
+    }
+    std::thread echoThread(EchoServer, srv);
+
+    int cli = MakeTcpSocket(address->GetSaFamily());
+    if (address->GetSaFamily() != AF_UNIX) {
+        (void)setsockopt(cli, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (!ExecConnectOnly(cli, address, 10)) {
+        printf("%s: bench connect failed\n", name);
+        echoThread.detach();
+        return;
+    }
+
+    std::string msg(BENCH_MSG_SIZE, 'x');
+    char buf[BENCH_MSG_SIZE];
+    timespec start = {0};
+    timespec end = {0};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < rounds; ++i) {
+        if (!ExecTcpSend(cli, msg, msg.size()) || !ReadFull(cli, buf, sizeof(buf))) {
+            printf("%s: bench round %d failed\n", name, i);
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (!GetConnTable().Close(GetConnTable().GetHandle(cli))) {
+        close(cli);
+    }
+    echoThread.join();
+    close(srv);
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("%-14s %d round trips of %d bytes: avg rtt %.2f us, %.0f msg/s\n", name, rounds, BENCH_MSG_SIZE,
+           ns / rounds / 1000, rounds / (ns / 1e9));
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = 100000;
+    if (argc >= 2) {
+        rounds = atoi(argv[1]);
+    }
+
+    NetAddress tcpAddr;
+    tcpAddr.SetAddress(TCP_IP);
+    tcpAddr.SetPort(TCP_PORT);
+
+    NetAddress udsAddr;
+    udsAddr.SetAddress(UDS_NAME);
+    udsAddr.SetFamilyBySaFamily(AF_UNIX);
+
+    RunPingPong("loopback tcp", &tcpAddr, rounds);
+    RunPingPong("unix stream", &udsAddr, rounds);
+
+    return 0;
+}
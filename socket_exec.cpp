@@ -1,5 +1,7 @@
 
 #include "socket_exec.h"
+#include <deque>
+#include <unordered_map>
 
 static constexpr const int DEFAULT_BUFFER_SIZE = 8192;
 
@@ -9,6 +11,71 @@ static constexpr const int ADDRESS_INVALID = -1;
 
 static constexpr const int NO_MEMORY = -2;
 
+static constexpr const int MAX_CACHED_FD = 65536;
+
+static constexpr const size_t MAX_TX_PENDING = 4096;
+
+static std::atomic<uint32_t> g_threadPlacement(static_cast<uint32_t>(ThreadPlacement::NONE));
+
+static std::atomic<uint32_t> g_nextCpu(0);
+
+static std::mutex g_placementMutex;
+
+static cpu_set_t g_placementCpus; /* captured by SetThreadPlacement; threads inherit their creator's pinning */
+
+static std::atomic<uint32_t> g_timestampFlags(0);
+
+static LatencyHistogram g_kernelToUserHistogram;
+
+static LatencyHistogram g_userToCallbackDoneHistogram;
+
+static LatencyHistogram g_sendToTxHistogram;
+
+/* send times still waiting for their TX timestamp, in SOF_TIMESTAMPING_OPT_ID key order */
+struct TxSendTimes {
+    bool stream = false;
+    uint32_t datagrams = 0; /* UDP key of the next send */
+    std::deque<std::pair<uint32_t, timespec>> pending;
+};
+
+static std::mutex g_txMutex;
+
+static std::unordered_map<int, TxSendTimes> g_txSendTimes;
+
+/* resolved once per socket so the send path does not pay two getsockopt calls per operation */
+struct SocketOptCache {
+    std::atomic<int> sockType;       /* 0 while unresolved */
+    std::atomic<int> sendBufferSize;
+};
+
+static SocketOptCache g_sockOptCache[MAX_CACHED_FD];
+
+static ConnTable g_connTable(MAX_CACHED_FD);
+
+static std::atomic<uint64_t> g_connHighWatermark(0);
+
+static std::atomic<uint64_t> g_connLowWatermark(0);
+
+static std::atomic<uint64_t> g_globalHighWatermark(0);
+
+static std::atomic<uint64_t> g_globalLowWatermark(0);
+
+static std::atomic<uint32_t> g_udpDropPolicy(static_cast<uint32_t>(UdpDropPolicy::PAUSE_READ));
+
+static std::atomic<uint64_t> g_globalUnconsumed(0);
+
+static std::atomic<uint64_t> g_sockUnconsumed[MAX_CACHED_FD];
+
+static std::atomic<uint64_t> g_recvPauses(0);
+
+static std::atomic<uint64_t> g_udpDiscarded(0);
+
+static std::mutex g_flowMutex;
+
+static std::condition_variable g_flowCond;
+
+static RecvMessageHandler g_recvMessageHandler;
+
 
 struct MessageData {
     MessageData() = delete;
@@ -25,6 +92,16 @@ struct MessageData {
     SocketRemoteInfo remoteInfo;
 };
 
+static bool IsTimestampSet(const timespec &ts)
+{
+    return ts.tv_sec != 0 || ts.tv_nsec != 0;
+}
+
+static int64_t DiffNs(const timespec &end, const timespec &start)
+{
+    return (static_cast<int64_t>(end.tv_sec) - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+}
+
 static std::string MakeAddressString(sockaddr *addr)
 {
     if (addr->sa_family == AF_INET) {
@@ -41,21 +118,29 @@ static std::string MakeAddressString(sockaddr *addr)
             return {};
         }
         return str;
+    } else if (addr->sa_family == AF_UNIX) {
+        auto *addrUn = reinterpret_cast<sockaddr_un *>(addr);
+        if (addrUn->sun_path[0] == '\0') {
+            size_t nameLen = strnlen(addrUn->sun_path + 1, sizeof(addrUn->sun_path) - 1);
+            return nameLen == 0 ? std::string() : "@" + std::string(addrUn->sun_path + 1, nameLen);
+        }
+        return std::string(addrUn->sun_path, strnlen(addrUn->sun_path, sizeof(addrUn->sun_path)));
     }
     return {};
 }
-static void OnRecvMessage(void *data, size_t len, sockaddr *addr)
+/* returns true when the registered handler took ownership of data */
+static bool OnRecvMessage(int sock, void *data, size_t len, sockaddr *addr, const RecvTimestamp &ts)
 {
     if (data == nullptr || len <= 0) {
         printf("OnRecvMessage nullptr or 0 \n");
-        return;
+        return false;
     }
 
     SocketRemoteInfo remoteInfo;
     std::string address = MakeAddressString(addr);
-    if (address.empty()) {
+    if (address.empty() && addr->sa_family != AF_UNIX) { /* unix peers are often unnamed */
         printf("OnRecvMessage address empty \n");
-        return;
+        return false;
     }
     remoteInfo.SetAddress(address);
     remoteInfo.SetFamily(addr->sa_family);
@@ -67,6 +152,12 @@ static void OnRecvMessage(void *data, size_t len, sockaddr *addr)
         remoteInfo.SetPort(ntohs(addr6->sin6_port));
     }
     remoteInfo.SetSize(len);
+
+    if (!g_recvMessageHandler) {
+        return false;
+    }
+    g_recvMessageHandler(sock, data, len, remoteInfo, ts);
+    return true;
 }
 
 
@@ -77,7 +168,8 @@ public:
 
     virtual ~MessageCallback() {};
 
-    virtual void OnMessage(int sock, void *data, size_t dataLen, sockaddr *addr) const = 0;
+    /* returns false when nothing kept data, so the receive loop frees it and credits flow control */
+    virtual bool OnMessage(int sock, void *data, size_t dataLen, sockaddr *addr, const RecvTimestamp &ts) const = 0;
 };
 
 class TcpMessageCallback final : public MessageCallback {
@@ -86,16 +178,21 @@ public:
 
     ~TcpMessageCallback() {};
 
-    void OnMessage(int sock, void *data, size_t dataLen, sockaddr *addr) const override
+    bool OnMessage(int sock, void *data, size_t dataLen, sockaddr *addr, const RecvTimestamp &ts) const override
     {
         (void)addr;
 
+        auto peer = const_cast<sockaddr *>(g_connTable.GetPeerAddr(g_connTable.GetHandle(sock)));
+        if (peer != nullptr) {
+            return OnRecvMessage(sock, data, dataLen, peer, ts);
+        }
+
         sa_family_t family;
         socklen_t len = sizeof(family);
         int ret = getsockname(sock, reinterpret_cast<sockaddr *>(&family), &len);
         if (ret < 0) {
             printf("OnMessage getsockname ret < 0 \n");
-            return;
+            return false;
         }
 
         if (family == AF_INET) {
@@ -105,21 +202,29 @@ public:
             ret = getpeername(sock, reinterpret_cast<sockaddr *>(&addr4), &len4);
             if (ret < 0) {
                 printf("OnMessage getpeername ret < 0 \n");
-                return;
+                return false;
             }
-            OnRecvMessage(data, dataLen, reinterpret_cast<sockaddr *>(&addr4));
-            return;
+            return OnRecvMessage(sock, data, dataLen, reinterpret_cast<sockaddr *>(&addr4), ts);
         } else if (family == AF_INET6) {
             sockaddr_in6 addr6 = {0};
             socklen_t len6 = sizeof(sockaddr_in6);
 
             ret = getpeername(sock, reinterpret_cast<sockaddr *>(&addr6), &len6);
             if (ret < 0) {
-                return;
+                return false;
             }
-            OnRecvMessage(data, dataLen, reinterpret_cast<sockaddr *>(&addr6));
-            return;
+            return OnRecvMessage(sock, data, dataLen, reinterpret_cast<sockaddr *>(&addr6), ts);
+        } else if (family == AF_UNIX) {
+            sockaddr_un addrUn = {0};
+            socklen_t lenUn = sizeof(sockaddr_un);
+
+            ret = getpeername(sock, reinterpret_cast<sockaddr *>(&addrUn), &lenUn);
+            if (ret < 0) {
+                return false;
+            }
+            return OnRecvMessage(sock, data, dataLen, reinterpret_cast<sockaddr *>(&addrUn), ts);
         }
+        return false;
     }
 };
 
@@ -129,9 +234,9 @@ public:
 
     ~UdpMessageCallback() {};
 
-    void OnMessage(int sock, void *data, size_t dataLen, sockaddr *addr) const override
+    bool OnMessage(int sock, void *data, size_t dataLen, sockaddr *addr, const RecvTimestamp &ts) const override
     {
-        OnRecvMessage(data, dataLen, addr);
+        return OnRecvMessage(sock, data, dataLen, addr, ts);
     }
 };
 
@@ -156,21 +261,245 @@ static bool MakeNonBlock(int sock)
     return true;
 }
 
-static bool PollSendData(int sock, const char *data, size_t size, sockaddr *addr, socklen_t addrLen)
+void SetThreadPlacement(ThreadPlacement placement)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_placementMutex);
+        CPU_ZERO(&g_placementCpus);
+        if (sched_getaffinity(0, sizeof(g_placementCpus), &g_placementCpus) < 0) {
+            printf("get affinity failed %s\n", strerror(errno));
+            return;
+        }
+    }
+    g_threadPlacement = static_cast<uint32_t>(placement);
+    printf("thread placement policy %u, online cpus %ld\n", static_cast<uint32_t>(placement),
+           sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+static int PickCpu(int sock, ThreadPlacement placement, const cpu_set_t &allowed)
 {
+    if (placement == ThreadPlacement::INCOMING_CPU) {
+        int cpu = -1;
+        socklen_t optLen = sizeof(cpu);
+        if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, reinterpret_cast<void *>(&cpu), &optLen) >= 0 &&
+            cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+            return cpu;
+        }
+    }
+
+    int count = CPU_COUNT(&allowed);
+    if (count <= 0) {
+        return -1;
+    }
+    uint32_t nth = g_nextCpu++ % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && nth-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/* Must run before the thread allocates its buffers: first touch then puts their pages on the local NUMA node. */
+static void PlaceIoThread(int sock)
+{
+    auto placement = static_cast<ThreadPlacement>(g_threadPlacement.load());
+    if (placement == ThreadPlacement::NONE) {
+        return;
+    }
+
+    cpu_set_t allowed;
+    {
+        std::lock_guard<std::mutex> lock(g_placementMutex);
+        allowed = g_placementCpus;
+    }
+    int cpu = PickCpu(sock, placement, allowed);
+    if (cpu < 0) {
+        printf("no cpu to place sock %d\n", sock);
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        printf("pin sock %d to cpu %d failed %s\n", sock, cpu, strerror(ret));
+        return;
+    }
+    if (placement == ThreadPlacement::INCOMING_CPU) {
+        /* steers SO_REUSEPORT groups so packets land on the queue this thread drains */
+        (void)setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, reinterpret_cast<void *>(&cpu), sizeof(cpu));
+    }
+
+    unsigned int curCpu = 0;
+    unsigned int node = 0;
+    (void)getcpu(&curCpu, &node);
+    printf("sock %d io thread placed on cpu %u numa node %u\n", sock, curCpu, node);
+}
+
+void SetTimestamping(uint32_t flags)
+{
+    g_timestampFlags = flags;
+    printf("timestamping flags 0x%x\n", flags);
+}
+
+void DumpLatencyHistograms()
+{
+    g_kernelToUserHistogram.Dump("kernel to userspace");
+    g_userToCallbackDoneHistogram.Dump("userspace to callback done");
+    g_sendToTxHistogram.Dump("send call to kernel tx");
+}
+
+static void ApplyTimestamping(int sock)
+{
+    uint32_t flags = g_timestampFlags.load();
+    if (flags == 0) {
+        return;
+    }
+    int opt = 0;
+    if (flags & TIMESTAMP_RX_SOFTWARE) {
+        opt |= SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    }
+    if (flags & TIMESTAMP_RX_HARDWARE) {
+        opt |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    }
+    if (flags & TIMESTAMP_TX_SOFTWARE) {
+        /* OPT_ID tags each timestamp with the send it belongs to; the socket is new, so keys start at 0 */
+        opt |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY |
+               SOF_TIMESTAMPING_OPT_ID;
+        std::lock_guard<std::mutex> lock(g_txMutex);
+        g_txSendTimes.erase(sock);
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, reinterpret_cast<void *>(&opt), sizeof(opt)) < 0) {
+        printf("set timestamping on sock %d failed %s\n", sock, strerror(errno));
+    }
+}
+
+/* the key of a TCP send is the offset of its last byte on the connection, of a UDP send its sequence number */
+static void RecordTxSendTime(int sock, bool isStream, uint64_t streamBytes, const timespec &sendTime)
+{
+    std::lock_guard<std::mutex> lock(g_txMutex);
+    TxSendTimes &times = g_txSendTimes[sock];
+    times.stream = isStream;
+    uint32_t key = isStream ? static_cast<uint32_t>(streamBytes - 1) : times.datagrams++;
+    if (times.pending.size() >= MAX_TX_PENDING) {
+        times.pending.pop_front();
+    }
+    times.pending.emplace_back(key, sendTime);
+}
+
+/* undoes the RecordTxSendTime of a datagram the kernel refused, so later keys still match */
+static void ForgetTxSendTime(int sock)
+{
+    std::lock_guard<std::mutex> lock(g_txMutex);
+    auto it = g_txSendTimes.find(sock);
+    if (it == g_txSendTimes.end() || it->second.pending.empty()) {
+        return;
+    }
+    it->second.pending.pop_back();
+    it->second.datagrams--;
+}
+
+static void RecordTxTimestamp(int sock, uint32_t key, const timespec &txTime)
+{
+    std::lock_guard<std::mutex> lock(g_txMutex);
+    auto it = g_txSendTimes.find(sock);
+    if (it == g_txSendTimes.end()) {
+        return;
+    }
+    auto &pending = it->second.pending;
+    /*
+     * Timestamps are queued in key order. TCP stamps only the last write merged into a segment, which
+     * carries the earlier ones with it; an older datagram still pending lost its timestamp.
+     */
+    while (!pending.empty() && static_cast<int32_t>(key - pending.front().first) > 0) {
+        if (it->second.stream) {
+            g_sendToTxHistogram.Record(DiffNs(txTime, pending.front().second));
+        }
+        pending.pop_front();
+    }
+    if (!pending.empty() && pending.front().first == key) {
+        g_sendToTxHistogram.Record(DiffNs(txTime, pending.front().second));
+        pending.pop_front();
+    }
+}
+
+/* non-blocking; called after a send and by the receive loop on POLLERR, whichever sees them first */
+static void DrainTxTimestamps(int sock)
+{
+    char control[CMSG_SPACE(sizeof(scm_timestamping)) + CMSG_SPACE(sizeof(sock_extended_err)) + 64];
+    while (true) {
+        msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
+        const timespec *txTime = nullptr;
+        const sock_extended_err *err = nullptr;
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                txTime = &reinterpret_cast<scm_timestamping *>(CMSG_DATA(cmsg))->ts[0];
+            } else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                       (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                err = reinterpret_cast<sock_extended_err *>(CMSG_DATA(cmsg));
+            }
+        }
+        if (txTime != nullptr && err != nullptr && err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING &&
+            IsTimestampSet(*txTime)) {
+            RecordTxTimestamp(sock, err->ee_data, *txTime);
+        }
+    }
+}
+
+static bool ResolveSocketOpts(int sock, int *sockType, int *sendBufferSize)
+{
+    if (sock >= 0 && sock < MAX_CACHED_FD) {
+        int cachedType = g_sockOptCache[sock].sockType.load(std::memory_order_acquire);
+        if (cachedType != 0) {
+            *sockType = cachedType;
+            *sendBufferSize = g_sockOptCache[sock].sendBufferSize.load(std::memory_order_relaxed);
+            return true;
+        }
+    }
+
     int bufferSize = DEFAULT_BUFFER_SIZE;
     int opt = 0;
     socklen_t optLen = sizeof(opt);
     if (getsockopt(sock, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<void *>(&opt), &optLen) >= 0 && opt > 0) {
         bufferSize = opt;
     }
-    int sockType = 0;
-    optLen = sizeof(sockType);
-    if (getsockopt(sock, SOL_SOCKET, SO_TYPE, reinterpret_cast<void *>(&sockType), &optLen) < 0) {
+    int type = 0;
+    optLen = sizeof(type);
+    if (getsockopt(sock, SOL_SOCKET, SO_TYPE, reinterpret_cast<void *>(&type), &optLen) < 0) {
         printf("get sock opt sock type failed = %s\n", strerror(errno));
         return false;
     }
 
+    if (sock >= 0 && sock < MAX_CACHED_FD) {
+        g_sockOptCache[sock].sendBufferSize.store(bufferSize, std::memory_order_relaxed);
+        g_sockOptCache[sock].sockType.store(type, std::memory_order_release);
+    }
+    *sockType = type;
+    *sendBufferSize = bufferSize;
+    return true;
+}
+
+static void ForgetSocketOpts(int sock)
+{
+    if (sock >= 0 && sock < MAX_CACHED_FD) {
+        g_sockOptCache[sock].sockType.store(0, std::memory_order_release);
+    }
+}
+
+template <bool IS_STREAM>
+static bool PollSendLoop(int sock, const char *data, size_t size, sockaddr *addr, socklen_t addrLen, int bufferSize,
+                         uint64_t *syscalls = nullptr)
+{
+    bool txTimestamp = (g_timestampFlags.load() & TIMESTAMP_TX_SOFTWARE) != 0;
+    timespec sendTime = {0};
+
     auto curPos = data;
     auto leftSize = size;
     nfds_t num = 1;
@@ -190,8 +519,21 @@ static bool PollSendData(int sock, const char *data, size_t size, sockaddr *addr
             return false;
         }
 
-        size_t sendSize = (sockType == SOCK_STREAM ? leftSize : std::min<size_t>(leftSize, bufferSize));
-        auto sendLen = sendto(sock, curPos, sendSize, 0, addr, addrLen);
+        size_t sendSize = (IS_STREAM ? leftSize : std::min<size_t>(leftSize, bufferSize));
+        if (txTimestamp) {
+            clock_gettime(CLOCK_REALTIME, &sendTime);
+            /* a datagram's key is known up front; the receive loop may drain its timestamp before sendto returns */
+            if (!IS_STREAM) {
+                RecordTxSendTime(sock, false, 0, sendTime);
+            }
+        }
+        auto sendLen = sendto(sock, curPos, sendSize, MSG_NOSIGNAL, addr, addrLen);
+        if (syscalls != nullptr) {
+            (*syscalls)++;
+        }
+        if (!IS_STREAM && txTimestamp && sendLen < 0) {
+            ForgetTxSendTime(sock);
+        }
         if (sendLen < 0) {
             if (errno == EAGAIN) {
                 continue;
@@ -202,10 +544,19 @@ static bool PollSendData(int sock, const char *data, size_t size, sockaddr *addr
         if (sendLen == 0) {
             break;
         }
+        /* counted per write, so the connection's byte count stays the offset the kernel keys timestamps by */
+        uint64_t streamBytes = IS_STREAM ? g_connTable.AddSendBytes(sock, sendLen) : 0;
+        if (IS_STREAM && txTimestamp) {
+            RecordTxSendTime(sock, true, streamBytes, sendTime);
+        }
         curPos += sendLen;
         leftSize -= sendLen;
     }
 
+    if (txTimestamp) {
+        DrainTxTimestamps(sock);
+    }
+
     if (leftSize != 0) {
         printf("send not complete\n");
         return false;
@@ -213,8 +564,155 @@ static bool PollSendData(int sock, const char *data, size_t size, sockaddr *addr
     return true;
 }
 
-static void PollRecvData(int sock, sockaddr *addr, socklen_t addrLen, bool isTcp, const MessageCallback &callback)
+static bool PollSendData(int sock, const char *data, size_t size, sockaddr *addr, socklen_t addrLen)
+{
+    int sockType = 0;
+    int bufferSize = DEFAULT_BUFFER_SIZE;
+    if (!ResolveSocketOpts(sock, &sockType, &bufferSize)) {
+        return false;
+    }
+    if (sockType == SOCK_STREAM) {
+        return PollSendLoop<true>(sock, data, size, addr, addrLen, bufferSize);
+    }
+    return PollSendLoop<false>(sock, data, size, addr, addrLen, bufferSize);
+}
+
+void SetRecvMessageHandler(RecvMessageHandler handler)
+{
+    g_recvMessageHandler = std::move(handler);
+}
+
+void SetRecvFlowControl(uint64_t connHigh, uint64_t connLow, uint64_t globalHigh, uint64_t globalLow)
+{
+    g_connHighWatermark = connHigh;
+    g_connLowWatermark = std::min(connLow, connHigh);
+    g_globalHighWatermark = globalHigh;
+    g_globalLowWatermark = std::min(globalLow, globalHigh);
+    g_flowCond.notify_all();
+}
+
+void SetUdpDropPolicy(UdpDropPolicy policy)
+{
+    g_udpDropPolicy = static_cast<uint32_t>(policy);
+    g_flowCond.notify_all();
+}
+
+static void ChargeRecvData(int sock, size_t len)
+{
+    g_globalUnconsumed.fetch_add(len, std::memory_order_relaxed);
+    if (sock >= 0 && sock < MAX_CACHED_FD) {
+        g_sockUnconsumed[sock].fetch_add(len, std::memory_order_relaxed);
+    }
+}
+
+static uint64_t SaturatingSub(std::atomic<uint64_t> &counter, uint64_t len)
+{
+    uint64_t cur = counter.load(std::memory_order_relaxed);
+    uint64_t next = 0;
+    do {
+        next = cur > len ? cur - len : 0;
+    } while (!counter.compare_exchange_weak(cur, next, std::memory_order_relaxed));
+    return next;
+}
+
+void ExecConsumeRecvData(int sockfd, size_t len)
+{
+    uint64_t global = SaturatingSub(g_globalUnconsumed, len);
+    uint64_t conn = 0;
+    if (sockfd >= 0 && sockfd < MAX_CACHED_FD) {
+        conn = SaturatingSub(g_sockUnconsumed[sockfd], len);
+    }
+    /* only wake paused readers when this consume is what brought a count under its low watermark */
+    if ((conn <= g_connLowWatermark.load() && conn + len > g_connLowWatermark.load()) ||
+        (global <= g_globalLowWatermark.load() && global + len > g_globalLowWatermark.load())) {
+        std::lock_guard<std::mutex> lock(g_flowMutex);
+        g_flowCond.notify_all();
+    }
+}
+
+static bool OverHighWatermark(int sock)
+{
+    uint64_t connHigh = g_connHighWatermark.load(std::memory_order_relaxed);
+    uint64_t globalHigh = g_globalHighWatermark.load(std::memory_order_relaxed);
+    if (connHigh != 0 && sock >= 0 && sock < MAX_CACHED_FD &&
+        g_sockUnconsumed[sock].load(std::memory_order_relaxed) >= connHigh) {
+        return true;
+    }
+    return globalHigh != 0 && g_globalUnconsumed.load(std::memory_order_relaxed) >= globalHigh;
+}
+
+static bool AtOrBelowLowWatermark(int sock)
+{
+    uint64_t connHigh = g_connHighWatermark.load();
+    uint64_t globalHigh = g_globalHighWatermark.load();
+    if (connHigh != 0 && sock >= 0 && sock < MAX_CACHED_FD &&
+        g_sockUnconsumed[sock].load() > g_connLowWatermark.load()) {
+        return false;
+    }
+    return globalHigh == 0 || g_globalUnconsumed.load() <= g_globalLowWatermark.load();
+}
+
+/* blocks the socket's reader until there is credit again, so unread data backs up into the kernel */
+static void WaitForRecvCredit(int sock)
+{
+    g_recvPauses.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> lock(g_flowMutex);
+    while (!AtOrBelowLowWatermark(sock)) {
+        g_flowCond.wait_for(lock, std::chrono::milliseconds(DEFAULT_POLL_TIMEOUT));
+    }
+}
+
+void DumpRecvFlowStats()
+{
+    printf("unconsumed %lu bytes, reader pauses %lu, udp discarded %lu\n", g_globalUnconsumed.load(),
+           g_recvPauses.load(), g_udpDiscarded.load());
+}
+
+/* the receive thread owns closing its connection; untracked ones are closed directly */
+static void CloseConnection(int sock)
+{
+    ForgetSocketOpts(sock);
+    uint64_t handle = g_connTable.GetHandle(sock);
+    if (handle == ConnTable::INVALID_HANDLE) {
+        close(sock);
+        return;
+    }
+    (void)g_connTable.Close(handle);
+}
+
+/* sets group when the datagram's destination (from IP_PKTINFO / IPV6_PKTINFO) is a multicast address */
+static bool MakeMulticastGroup(cmsghdr *cmsg, MulticastAddr *group)
 {
+    if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+        auto *info = reinterpret_cast<in_pktinfo *>(CMSG_DATA(cmsg));
+        if (IN_MULTICAST(ntohl(info->ipi_addr.s_addr))) {
+            *group = {};
+            (void)memcpy(group->words, &info->ipi_addr, sizeof(info->ipi_addr));
+            group->family = AF_INET;
+            return true;
+        }
+    } else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+        auto *info = reinterpret_cast<in6_pktinfo *>(CMSG_DATA(cmsg));
+        if (IN6_IS_ADDR_MULTICAST(&info->ipi6_addr)) {
+            *group = {};
+            (void)memcpy(group->words, &info->ipi6_addr, sizeof(info->ipi6_addr));
+            group->family = AF_INET6;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Callback is a final class at the thread entry points, so OnMessage is bound statically and can be inlined. */
+template <bool IS_TCP, typename Callback>
+static void PollRecvLoop(int sock, sockaddr *addr, socklen_t addrLen, const Callback &callback)
+{
+    PlaceIoThread(sock);
+    /* a closed socket's unconsumed bytes stay in the global count; its fd number starts over */
+    if (sock >= 0 && sock < MAX_CACHED_FD) {
+        g_sockUnconsumed[sock].store(0, std::memory_order_relaxed);
+    }
+
     int bufferSize = DEFAULT_BUFFER_SIZE;
     int opt = 0;
     socklen_t optLen = sizeof(opt);
@@ -229,6 +727,11 @@ static void PollRecvData(int sock, sockaddr *addr, socklen_t addrLen, bool isTcp
 
     auto addrDeleter = [](sockaddr *a) { free(reinterpret_cast<void *>(a)); };
     std::unique_ptr<sockaddr, decltype(addrDeleter)> pAddr(addr, addrDeleter);
+    if (buf == nullptr) {
+        printf("PollRecvData buf nullptr\n");
+        return;
+    }
+    (void)memset(buf.get(), 0, bufferSize);
 
     nfds_t num = 1;
     pollfd fds[1] = {{0}};
@@ -236,7 +739,22 @@ static void PollRecvData(int sock, sockaddr *addr, socklen_t addrLen, bool isTcp
     fds[0].events = 0;
     fds[0].events |= POLLIN;
 
+    char control[CMSG_SPACE(sizeof(scm_timestamping)) + CMSG_SPACE(sizeof(in6_pktinfo))];
+
+    bool discard = false; /* like a paused reader, discards from the high watermark down to the low one */
+    std::shared_ptr<MulticastSocketStats> multicastStats;
     while (true) {
+        if (discard && AtOrBelowLowWatermark(sock)) {
+            discard = false;
+        }
+        if (!discard && OverHighWatermark(sock)) {
+            if (IS_TCP || static_cast<UdpDropPolicy>(g_udpDropPolicy.load()) == UdpDropPolicy::PAUSE_READ) {
+                WaitForRecvCredit(sock);
+            } else {
+                discard = true;
+            }
+        }
+
         int ret = poll(fds, num, DEFAULT_POLL_TIMEOUT);
         if (ret < 0) {
             printf("poll to recv failed %s\n", strerror(errno));
@@ -246,37 +764,106 @@ static void PollRecvData(int sock, sockaddr *addr, socklen_t addrLen, bool isTcp
         if (ret == 0) {
             continue;
         }
+        if (fds[0].revents & POLLERR) {
+            DrainTxTimestamps(sock);
+            if (!(fds[0].revents & POLLIN)) {
+                continue;
+            }
+        }
         (void)memset(buf.get(), 0, bufferSize);
-        socklen_t tempAddrLen = addrLen;
-        auto recvLen = recvfrom(sock, buf.get(), bufferSize, 0, addr, &tempAddrLen);
+        iovec iov = {buf.get(), static_cast<size_t>(bufferSize)};
+        msghdr msg = {0};
+        msg.msg_name = addr;
+        msg.msg_namelen = addrLen;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        auto recvLen = recvmsg(sock, &msg, 0);
+        socklen_t nameLen = std::max<socklen_t>(msg.msg_namelen, sizeof(sa_family_t));
+        if (addr != nullptr && nameLen < addrLen) {
+            /* shorter (e.g. unnamed unix) senders must not inherit the previous sender's address bytes */
+            (void)memset(reinterpret_cast<char *>(addr) + nameLen, 0, addrLen - nameLen);
+        }
+        RecvTimestamp ts = {{0}};
+        clock_gettime(CLOCK_REALTIME, &ts.user);
         if (recvLen < 0) {
             if (errno == EAGAIN) {
                 printf("PollRecvData EAGAIN\n");
                 continue;
             }
             printf("recv failed %s\n", strerror(errno));
+            if (IS_TCP) {
+                CloseConnection(sock);
+            }
             return;
         }
         if (recvLen == 0) {
-            if (isTcp) {
-                close(sock);
+            if (IS_TCP) {
+                CloseConnection(sock);
                 pthread_exit(NULL);
             }
             continue;
         }
 
+        if (IS_TCP) {
+            g_connTable.AddRecvBytes(sock, recvLen);
+        }
+
+        MulticastAddr group;
+        bool multicast = false;
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                auto *tss = reinterpret_cast<scm_timestamping *>(CMSG_DATA(cmsg));
+                ts.software = tss->ts[0];
+                ts.hardware = tss->ts[2];
+            } else if (!IS_TCP) {
+                multicast = MakeMulticastGroup(cmsg, &group) || multicast;
+            }
+        }
+        size_t skipLen = 0;
+        if (!IS_TCP && multicast) {
+            if (multicastStats == nullptr) {
+                multicastStats = AttachMulticastStats(sock);
+            }
+            skipLen = OnMulticastMessage(multicastStats.get(), group, addr, buf.get(), recvLen);
+            recvLen -= skipLen;
+        }
+
+        if (!IS_TCP && discard) {
+            g_udpDiscarded.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
         void *data = malloc(recvLen);
         if (data == nullptr) {
             printf("PollRecvData data nullptr\n");
             return;
         }
-        printf("copy ret = %d\n", memcpy(data, buf.get(), recvLen));
-        printf("PollRecvData data %s, sock is %d\n", data, sock);
-        callback.OnMessage(sock, data, recvLen, addr);
+        printf("copy ret = %d\n", memcpy(data, buf.get() + skipLen, recvLen));
+        printf("PollRecvData data %.*s, sock is %d\n", static_cast<int>(recvLen), reinterpret_cast<char *>(data),
+               sock);
+        if (IsTimestampSet(ts.software)) {
+            g_kernelToUserHistogram.Record(DiffNs(ts.user, ts.software));
+        }
+        if (IsCaptureEnabled()) {
+            uint64_t handle = IS_TCP ? g_connTable.GetHandle(sock) : ConnTable::INVALID_HANDLE;
+            const sockaddr *remote = IS_TCP ? g_connTable.GetPeerAddr(handle) : addr;
+            CaptureMessage(IS_TCP, handle, remote, data, recvLen, IsTimestampSet(ts.software) ? ts.software : ts.user);
+        }
+        ChargeRecvData(sock, recvLen);
+        if (!callback.OnMessage(sock, data, recvLen, addr, ts)) {
+            free(data);
+            ExecConsumeRecvData(sock, recvLen);
+        }
+        if (IsTimestampSet(ts.software)) {
+            timespec done = {0};
+            clock_gettime(CLOCK_REALTIME, &done);
+            g_userToCallbackDoneHistogram.Record(DiffNs(done, ts.user));
+        }
     }
 }
 
-
 static bool NonBlockConnect(int sock, sockaddr *addr, socklen_t addrLen, uint32_t timeoutSec)
 {
     int ret = connect(sock, addr, addrLen);
@@ -320,7 +907,8 @@ static bool NonBlockConnect(int sock, sockaddr *addr, socklen_t addrLen, uint32_
     return true;
 }
 
-static void GetAddr(NetAddress *address, sockaddr_in *addr4, sockaddr_in6 *addr6, sockaddr **addr, socklen_t *len)
+static void GetAddr(NetAddress *address, sockaddr_in *addr4, sockaddr_in6 *addr6, sockaddr_un *addrUn,
+                    sockaddr **addr, socklen_t *len)
 {
     sa_family_t family = address->GetSaFamily();
     if (family == AF_INET) {
@@ -335,15 +923,31 @@ static void GetAddr(NetAddress *address, sockaddr_in *addr4, sockaddr_in6 *addr6
         inet_pton(AF_INET6, address->GetAddress().c_str(), &addr6->sin6_addr);
         *addr = reinterpret_cast<sockaddr *>(addr6);
         *len = sizeof(sockaddr_in6);
+    } else if (family == AF_UNIX) {
+        const std::string &path = address->GetAddress();
+        if (path.empty() || path.size() >= sizeof(addrUn->sun_path)) {
+            printf("unix socket path length %zu invalid\n", path.size());
+            return;
+        }
+        addrUn->sun_family = AF_UNIX;
+        (void)memcpy(addrUn->sun_path, path.c_str(), path.size());
+        if (path[0] == '@') {
+            /* abstract namespace: leading NUL, and the name length is carried by the address length */
+            addrUn->sun_path[0] = '\0';
+            *len = offsetof(sockaddr_un, sun_path) + path.size();
+        } else {
+            *len = sizeof(sockaddr_un);
+        }
+        *addr = reinterpret_cast<sockaddr *>(addrUn);
     }
 }
 
 int MakeTcpSocket(sa_family_t family)
 {
-    if (family != AF_INET && family != AF_INET6) {
+    if (family != AF_INET && family != AF_INET6 && family != AF_UNIX) {
         return -1;
     }
-    int sock = socket(family, SOCK_STREAM, IPPROTO_TCP);
+    int sock = socket(family, SOCK_STREAM, family == AF_UNIX ? 0 : IPPROTO_TCP);
     if (sock < 0) {
         printf("make tcp socket failed errno is %d %s\n", errno, strerror(errno));
         return -1;
@@ -352,15 +956,16 @@ int MakeTcpSocket(sa_family_t family)
         close(sock);
         return -1;
     }
+    ForgetSocketOpts(sock);
     return sock;
 }
 
 int MakeUdpSocket(sa_family_t family)
 {
-    if (family != AF_INET && family != AF_INET6) {
+    if (family != AF_INET && family != AF_INET6 && family != AF_UNIX) {
         return -1;
     }
-    int sock = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+    int sock = socket(family, SOCK_DGRAM, family == AF_UNIX ? 0 : IPPROTO_UDP);
     if (sock < 0) {
         printf("make udp socket failed errno is %d %s\n", errno, strerror(errno));
         return -1;
@@ -369,27 +974,78 @@ int MakeUdpSocket(sa_family_t family)
         close(sock);
         return -1;
     }
+    ForgetSocketOpts(sock);
     return sock;
 }
 
+/* a unix socket path is stale when it is a socket nobody listens on; anything else is left alone */
+static bool IsStaleUnixPath(int sockfd, const sockaddr_un &addrUn, socklen_t len)
+{
+    struct stat st = {0};
+    if (lstat(addrUn.sun_path, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+        return false;
+    }
+    int type = SOCK_STREAM;
+    socklen_t typeLen = sizeof(type);
+    (void)getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &typeLen);
+    int probe = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+    if (probe < 0) {
+        return false;
+    }
+    bool stale = (connect(probe, reinterpret_cast<const sockaddr *>(&addrUn), len) < 0 && errno == ECONNREFUSED);
+    close(probe);
+    return stale;
+}
+
+static bool IsMulticastAddr(const sockaddr *addr)
+{
+    if (addr->sa_family == AF_INET) {
+        return IN_MULTICAST(ntohl(reinterpret_cast<const sockaddr_in *>(addr)->sin_addr.s_addr));
+    }
+    if (addr->sa_family == AF_INET6) {
+        return IN6_IS_ADDR_MULTICAST(&reinterpret_cast<const sockaddr_in6 *>(addr)->sin6_addr);
+    }
+    return false;
+}
+
 bool ExecBind(int sockfd, NetAddress *address)
 {
     sockaddr_in addr4 = {0};
     sockaddr_in6 addr6 = {0};
+    sockaddr_un addrUn = {0};
     sockaddr *addr = nullptr;
     socklen_t len;
-    GetAddr(address, &addr4, &addr6, &addr, &len);
+    GetAddr(address, &addr4, &addr6, &addrUn, &addr, &len);
     if (addr == nullptr) {
         printf("addr family error\n");
         return false;
     }
 
+    /* every local subscriber of a group binds the same group and port */
+    bool multicast = IsMulticastAddr(addr);
+    if (multicast) {
+        int on = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+            printf("set reuse addr failed %s\n", strerror(errno));
+            return false;
+        }
+    }
+
     if (bind(sockfd, addr, len) < 0) {
-        if (errno != EADDRINUSE) {
+        if (errno != EADDRINUSE || multicast) {
+            /* a random port would never receive the group */
             printf("bind error is %s %d\n", strerror(errno), errno);
             return false;
         }
-        if (addr->sa_family == AF_INET) {
+        if (addr->sa_family == AF_UNIX) {
+            /* never take the path over from a server that is still running */
+            if (addrUn.sun_path[0] == '\0' || !IsStaleUnixPath(sockfd, addrUn, len)) {
+                printf("unix socket address in use\n");
+                return false;
+            }
+            printf("remove stale unix socket path\n");
+            (void)unlink(addrUn.sun_path);
+        } else if (addr->sa_family == AF_INET) {
             printf("distribute a random port\n");
             addr4.sin_port = 0; /* distribute a random port */
         } else if (addr->sa_family == AF_INET6) {
@@ -412,12 +1068,14 @@ bool ExecUdpBind(int sockfd, NetAddress *address)
     if (!ExecBind(sockfd, address)) {
         return false;
     }
+    ApplyTimestamping(sockfd);
 
     sockaddr_in addr4 = {0};
     sockaddr_in6 addr6 = {0};
+    sockaddr_un addrUn = {0};
     sockaddr *addr = nullptr;
     socklen_t len;
-    GetAddr(address, &addr4, &addr6, &addr, &len);
+    GetAddr(address, &addr4, &addr6, &addrUn, &addr, &len);
     if (addr == nullptr) {
         printf("addr family error\n");
         return false;
@@ -426,13 +1084,19 @@ bool ExecUdpBind(int sockfd, NetAddress *address)
     if (addr->sa_family == AF_INET) {
         auto pAddr4 = reinterpret_cast<sockaddr *>(malloc(sizeof(addr4)));
         printf("copy ret = %d\n", memcpy(pAddr4, &addr4, sizeof(addr4)));
-        std::thread serviceThread(PollRecvData, sockfd, pAddr4, sizeof(addr4), false,
+        std::thread serviceThread(PollRecvLoop<false, UdpMessageCallback>, sockfd, pAddr4, sizeof(addr4),
                                   UdpMessageCallback());
         serviceThread.detach();
     } else if (addr->sa_family == AF_INET6) {
         auto pAddr6 = reinterpret_cast<sockaddr *>(malloc(sizeof(addr6)));
         printf("copy ret = %d\n", memcpy(pAddr6,  &addr6, sizeof(addr6)));
-        std::thread serviceThread(PollRecvData, sockfd, pAddr6, sizeof(addr6), false,
+        std::thread serviceThread(PollRecvLoop<false, UdpMessageCallback>, sockfd, pAddr6, sizeof(addr6),
+                                  UdpMessageCallback());
+        serviceThread.detach();
+    } else if (addr->sa_family == AF_UNIX) {
+        auto pAddrUn = reinterpret_cast<sockaddr *>(malloc(sizeof(addrUn)));
+        (void)memcpy(pAddrUn, &addrUn, sizeof(addrUn));
+        std::thread serviceThread(PollRecvLoop<false, UdpMessageCallback>, sockfd, pAddrUn, sizeof(addrUn),
                                   UdpMessageCallback());
         serviceThread.detach();
     }
@@ -444,9 +1108,10 @@ bool ExecUdpSend(int sockfd, NetAddress *address, std::string send_str, socklen_
 {
     sockaddr_in addr4 = {0};
     sockaddr_in6 addr6 = {0};
+    sockaddr_un addrUn = {0};
     sockaddr *addr = nullptr;
     socklen_t len;
-    GetAddr(address, &addr4, &addr6, &addr, &len);
+    GetAddr(address, &addr4, &addr6, &addrUn, &addr, &len);
     if (addr == nullptr) {
         printf("addr family error\n");
         return false;
@@ -458,18 +1123,178 @@ bool ExecUdpSend(int sockfd, NetAddress *address, std::string send_str, socklen_
     return true;
 }
 
+static bool ExecGroupMembership(int sockfd, NetAddress *group, const std::string &source, uint32_t ifIndex,
+                                bool join)
+{
+    sockaddr_in addr4 = {0};
+    sockaddr_in6 addr6 = {0};
+    sockaddr_un addrUn = {0};
+    sockaddr *addr = nullptr;
+    socklen_t len;
+    GetAddr(group, &addr4, &addr6, &addrUn, &addr, &len);
+    if (addr == nullptr || addr->sa_family == AF_UNIX) {
+        printf("multicast group family error\n");
+        return false;
+    }
+    int level = (addr->sa_family == AF_INET6) ? IPPROTO_IPV6 : IPPROTO_IP;
+
+    int ret = 0;
+    if (source.empty()) {
+        group_req req = {0};
+        req.gr_interface = ifIndex;
+        (void)memcpy(&req.gr_group, addr, len);
+        ret = setsockopt(sockfd, level, join ? MCAST_JOIN_GROUP : MCAST_LEAVE_GROUP, &req, sizeof(req));
+    } else {
+        NetAddress sourceAddr(*group);
+        std::string sourceStr = source;
+        sourceAddr.SetAddress(sourceStr);
+        sockaddr_in src4 = {0};
+        sockaddr_in6 src6 = {0};
+        sockaddr *src = nullptr;
+        socklen_t srcLen;
+        GetAddr(&sourceAddr, &src4, &src6, &addrUn, &src, &srcLen);
+
+        group_source_req req = {0};
+        req.gsr_interface = ifIndex;
+        (void)memcpy(&req.gsr_group, addr, len);
+        (void)memcpy(&req.gsr_source, src, srcLen);
+        ret = setsockopt(sockfd, level, join ? MCAST_JOIN_SOURCE_GROUP : MCAST_LEAVE_SOURCE_GROUP, &req,
+                         sizeof(req));
+    }
+    if (ret < 0) {
+        printf("%s multicast group %s failed %s\n", join ? "join" : "leave", group->GetAddress().c_str(),
+               strerror(errno));
+        return false;
+    }
+    if (!join) {
+        return true;
+    }
+
+    /* the receive loop reads the destination address to tell groups apart */
+    int on = 1;
+    if (addr->sa_family == AF_INET6) {
+        ret = setsockopt(sockfd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on));
+    } else {
+        ret = setsockopt(sockfd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+    }
+    if (ret < 0) {
+        printf("enable pktinfo failed %s\n", strerror(errno));
+    }
+    return true;
+}
+
+bool ExecUdpJoinGroup(int sockfd, NetAddress *group, const std::string &source, uint32_t ifIndex)
+{
+    return ExecGroupMembership(sockfd, group, source, ifIndex, true);
+}
+
+bool ExecUdpSubscribe(int sockfd, NetAddress *group, const std::string &source, uint32_t ifIndex)
+{
+    return ExecUdpBind(sockfd, group) && ExecGroupMembership(sockfd, group, source, ifIndex, true);
+}
+
+bool ExecUdpLeaveGroup(int sockfd, NetAddress *group, const std::string &source, uint32_t ifIndex)
+{
+    return ExecGroupMembership(sockfd, group, source, ifIndex, false);
+}
+
+bool ExecUdpSetMulticast(int sockfd, sa_family_t family, bool loop, int ttl, uint32_t ifIndex)
+{
+    int ret = 0;
+    if (family == AF_INET) {
+        int loopOpt = loop ? 1 : 0;
+        ret |= setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loopOpt, sizeof(loopOpt));
+        ret |= setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        if (ifIndex != 0) {
+            ip_mreqn mreq = {0};
+            mreq.imr_ifindex = static_cast<int>(ifIndex);
+            ret |= setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq));
+        }
+    } else if (family == AF_INET6) {
+        unsigned int loopOpt = loop ? 1 : 0;
+        ret |= setsockopt(sockfd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loopOpt, sizeof(loopOpt));
+        ret |= setsockopt(sockfd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl));
+        if (ifIndex != 0) {
+            ret |= setsockopt(sockfd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifIndex, sizeof(ifIndex));
+        }
+    } else {
+        printf("multicast family error\n");
+        return false;
+    }
+    if (ret != 0) {
+        printf("set multicast options failed %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool ExecUdpPublish(int sockfd, NetAddress *group, const std::string &payload)
+{
+    sockaddr_in addr4 = {0};
+    sockaddr_in6 addr6 = {0};
+    sockaddr_un addrUn = {0};
+    sockaddr *addr = nullptr;
+    socklen_t len;
+    GetAddr(group, &addr4, &addr6, &addrUn, &addr, &len);
+    if (addr == nullptr) {
+        printf("addr family error\n");
+        return false;
+    }
+
+    MulticastHeader header;
+    MakeMulticastHeader(sockfd, &header);
+    iovec iov[2] = {{&header, sizeof(header)}, {const_cast<char *>(payload.data()), payload.size()}};
+    msghdr msg = {0};
+    msg.msg_name = addr;
+    msg.msg_namelen = len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    bool txTimestamp = (g_timestampFlags.load() & TIMESTAMP_TX_SOFTWARE) != 0;
+    timespec sendTime = {0};
+    pollfd fds[1] = {{0}};
+    fds[0].fd = sockfd;
+    fds[0].events = POLLOUT;
+    while (true) {
+        /* recorded first: the receive loop may drain the timestamp before sendmsg returns */
+        if (txTimestamp) {
+            clock_gettime(CLOCK_REALTIME, &sendTime);
+            RecordTxSendTime(sockfd, false, 0, sendTime);
+        }
+        if (sendmsg(sockfd, &msg, 0) >= 0) {
+            break;
+        }
+        if (txTimestamp) {
+            ForgetTxSendTime(sockfd);
+        }
+        if (errno != EAGAIN && errno != EINTR) {
+            printf("publish failed %s\n", strerror(errno));
+            return false;
+        }
+        if (poll(fds, 1, DEFAULT_POLL_TIMEOUT) <= 0) {
+            printf("poll to publish timeout\n");
+            return false;
+        }
+    }
+    if (txTimestamp) {
+        DrainTxTimestamps(sockfd);
+    }
+    return true;
+}
+
 bool ExecTcpBind(int sockfd, NetAddress *address)
 {
     return ExecBind(sockfd, address);
 }
 
-bool ExecConnect(int sockfd, NetAddress *address, uint32_t timeoutSec)
+bool ExecConnectOnly(int sockfd, NetAddress *address, uint32_t timeoutSec)
 {
     sockaddr_in addr4 = {0};
     sockaddr_in6 addr6 = {0};
+    sockaddr_un addrUn = {0};
     sockaddr *addr = nullptr;
     socklen_t len;
-    GetAddr(address, &addr4, &addr6, &addr, &len);
+    GetAddr(address, &addr4, &addr6, &addrUn, &addr, &len);
     if (addr == nullptr) {
         printf("addr family error\n");
         return false;
@@ -481,14 +1306,55 @@ bool ExecConnect(int sockfd, NetAddress *address, uint32_t timeoutSec)
     }
 
     printf("connect success\n");
-    std::thread serviceThread(PollRecvData, sockfd, nullptr, 0, true,
+    if (g_connTable.Add(sockfd, addr, len) == ConnTable::INVALID_HANDLE) {
+        /* still usable: the receive path falls back to getpeername, only stats and broadcast miss it */
+        printf("sock %d served untracked\n", sockfd);
+    }
+    return true;
+}
+
+bool ExecConnect(int sockfd, NetAddress *address, uint32_t timeoutSec)
+{
+    if (!ExecConnectOnly(sockfd, address, timeoutSec)) {
+        return false;
+    }
+    /* only here: TX timestamps queue on the error queue, which only the library's receive loop drains */
+    ApplyTimestamping(sockfd);
+    std::thread serviceThread(PollRecvLoop<true, TcpMessageCallback>, sockfd, nullptr, 0,
                               TcpMessageCallback());
     serviceThread.detach();
     return true;
 }
 
+static bool SendConnected(int sockfd, const char *data, size_t size)
+{
+    g_connTable.AddSendCalls(sockfd, 1, 0);
+    bool sent = false;
+    if (TcpCorkWrite(sockfd, data, size, &sent)) {
+        return sent;
+    }
+    std::unique_lock<std::timed_mutex> sendLock;
+    /* fds past the table have no send lock; their writers are not serialized, as before tracking */
+    if (sockfd < MAX_CACHED_FD && !g_connTable.LockSend(sockfd, &sendLock, DEFAULT_POLL_TIMEOUT)) {
+        printf("wait for send lock timeout\n");
+        return false;
+    }
+    uint64_t syscalls = 0;
+    bool ok = PollSendLoop<true>(sockfd, data, size, nullptr, 0, DEFAULT_BUFFER_SIZE, &syscalls);
+    g_connTable.AddSendCalls(sockfd, 0, syscalls);
+    if (!ok) {
+        printf("send errno %d %s\n", errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
 bool ExecTcpSend(int sockfd, std::string send_str, socklen_t size) 
 {
+    if (g_connTable.GetHandle(sockfd) != ConnTable::INVALID_HANDLE) {
+        return SendConnected(sockfd, send_str.c_str(), size);
+    }
+
     sa_family_t family;
     socklen_t len = sizeof(sa_family_t);
     if (getsockname(sockfd, reinterpret_cast<sockaddr *>(&family), &len) < 0) {
@@ -510,6 +1376,12 @@ bool ExecTcpSend(int sockfd, std::string send_str, socklen_t size)
         if (ret >= 0 && addr6.sin6_port != 0) {
             connected = true;
         }
+    } else if (family == AF_UNIX) {
+        sockaddr_un addrUn = {0};
+        socklen_t lenUn = sizeof(addrUn);
+        if (getpeername(sockfd, reinterpret_cast<sockaddr *>(&addrUn), &lenUn) >= 0) {
+            connected = true;
+        }
     }
 
     if (!connected) {
@@ -517,17 +1389,15 @@ bool ExecTcpSend(int sockfd, std::string send_str, socklen_t size)
         return false;
     }
 
-    if (!PollSendData(sockfd, send_str.c_str(), size, nullptr, 0)) {
-        printf("send errno %d %s\n", errno, strerror(errno));
-        return false;
-    }
-    return true;
+    return SendConnected(sockfd, send_str.c_str(), size);
 }
 
 static void TcpListenConn(int socketFd)
 {
     while(true) {
-        int connfd = accept(socketFd, NULL, NULL);
+        sockaddr_storage peer = {0};
+        socklen_t peerLen = sizeof(peer);
+        int connfd = accept(socketFd, reinterpret_cast<sockaddr *>(&peer), &peerLen);
         if (connfd == -1) {
             if (errno == EWOULDBLOCK) {
                 sleep(1);
@@ -539,7 +1409,12 @@ static void TcpListenConn(int socketFd)
         } else {
             printf("accept new connfd is %{public}d", connfd);
             MakeNonBlock(connfd);
-            std::thread serviceThread(PollRecvData, connfd, nullptr, 0, true,
+            ForgetSocketOpts(connfd);
+            ApplyTimestamping(connfd);
+            if (g_connTable.Add(connfd, reinterpret_cast<sockaddr *>(&peer), peerLen) == ConnTable::INVALID_HANDLE) {
+                printf("sock %d served untracked\n", connfd);
+            }
+            std::thread serviceThread(PollRecvLoop<true, TcpMessageCallback>, connfd, nullptr, 0,
                                       TcpMessageCallback());
             serviceThread.detach();
         }
@@ -561,3 +1436,22 @@ bool ExecTcpListen(int sockfd)
     return true;
 }
 
+ConnTable &GetConnTable()
+{
+    return g_connTable;
+}
+
+bool ExecCloseConn(uint64_t handle)
+{
+    int ret = 0;
+    if (!g_connTable.WithLiveFd(handle, [&ret](int fd) { ret = shutdown(fd, SHUT_RDWR); })) {
+        printf("close stale connection handle\n");
+        return false;
+    }
+    if (ret < 0) {
+        printf("shutdown errno %d %s\n", errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
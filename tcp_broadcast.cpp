@@ -0,0 +1,270 @@
+#include "socket_exec.h"
+#include <deque>
+#include <mutex>
+#include <sys/eventfd.h>
+#include <unordered_map>
+
+static constexpr const int BROADCAST_POLL_TIMEOUT = 500; // 0.5 Seconds
+
+static constexpr const int BROADCAST_RETRY_TIMEOUT = 1; // ms, while another writer holds a connection
+
+static constexpr const size_t MAX_IOV_PER_SEND = 16;
+
+struct BroadcastTask {
+    SharedPayload payload;
+    std::vector<uint64_t> handles;
+};
+
+struct PendingSend {
+    SharedPayload payload;
+    size_t offset;
+};
+
+struct ConnQueue {
+    uint64_t handle;
+    bool ready;
+    bool deferred; /* another writer holds the connection: retried on a timer, not on POLLOUT */
+    std::unique_lock<std::timed_mutex> sendLock; /* held from a payload's first byte to its last */
+    std::deque<PendingSend> queue;
+};
+
+/*
+ * Each shard owns the broadcast queues of the connections whose fd maps to it. Other writers of the
+ * same connection are kept out by its send lock, which a shard never waits for.
+ */
+struct BroadcastShard {
+    std::mutex mutex;
+    std::vector<BroadcastTask> tasks;
+    int eventFd;
+};
+
+static std::vector<std::unique_ptr<BroadcastShard>> g_shards;
+
+static std::once_flag g_shardsOnce;
+
+/* returns false when the connection should be dropped */
+static bool FlushQueue(int fd, ConnQueue &conn)
+{
+    ConnTable &table = GetConnTable();
+    conn.deferred = false;
+    if (!conn.sendLock.owns_lock()) {
+        /* bytes already accepted by a corked ExecTcpSend go first */
+        if (!TcpCorkDrain(fd) || !table.LockSend(fd, &conn.sendLock, 0)) {
+            conn.deferred = true;
+            return true;
+        }
+    }
+    while (!conn.queue.empty()) {
+        iovec iov[MAX_IOV_PER_SEND];
+        size_t iovNum = 0;
+        for (auto it = conn.queue.begin(); it != conn.queue.end() && iovNum < MAX_IOV_PER_SEND; ++it) {
+            iov[iovNum].iov_base = const_cast<char *>(it->payload->data() + it->offset);
+            iov[iovNum].iov_len = it->payload->size() - it->offset;
+            ++iovNum;
+        }
+        msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovNum;
+        /* connections are closed only under the send lock held here, so a live handle means an open fd */
+        if (!table.IsLive(conn.handle)) {
+            return false;
+        }
+        ssize_t sendLen = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sendLen < 0) {
+            table.AddSendCalls(fd, 0, 1);
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+            printf("broadcast send to fd %d failed %s\n", fd, strerror(errno));
+            return false;
+        }
+        table.AddSendBytes(fd, sendLen);
+
+        uint64_t done = 0;
+        size_t left = static_cast<size_t>(sendLen);
+        while (left > 0) {
+            PendingSend &front = conn.queue.front();
+            size_t remain = front.payload->size() - front.offset;
+            if (left < remain) {
+                front.offset += left;
+                break;
+            }
+            left -= remain;
+            conn.queue.pop_front();
+            ++done;
+        }
+        table.AddSendCalls(fd, done, 1);
+    }
+    /* between payloads other writers may go */
+    if (conn.queue.empty() || conn.queue.front().offset == 0) {
+        conn.sendLock.unlock();
+    }
+    return true;
+}
+
+static void TakeTasks(BroadcastShard &shard, std::unordered_map<int, ConnQueue> &queues)
+{
+    uint64_t value = 0;
+    (void)read(shard.eventFd, &value, sizeof(value));
+
+    std::vector<BroadcastTask> tasks;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        tasks.swap(shard.tasks);
+    }
+
+    ConnTable &table = GetConnTable();
+    for (auto &task : tasks) {
+        for (uint64_t handle : task.handles) {
+            int fd = table.GetFd(handle);
+            if (fd < 0) {
+                continue;
+            }
+            ConnQueue &conn = queues[fd];
+            if (conn.handle != handle) {
+                /* the fd was reused by a new connection: whatever was queued belonged to the old one */
+                conn.handle = handle;
+                conn.queue.clear();
+                if (conn.sendLock.owns_lock()) {
+                    conn.sendLock.unlock();
+                }
+            }
+            conn.queue.push_back({task.payload, 0});
+            conn.ready = true;
+        }
+    }
+}
+
+static void BroadcastLoop(BroadcastShard *shard)
+{
+    std::unordered_map<int, ConnQueue> queues;
+    std::vector<pollfd> fds;
+
+    while (true) {
+        fds.clear();
+        fds.push_back({shard->eventFd, POLLIN, 0});
+        bool deferred = false;
+        for (auto &entry : queues) {
+            if (entry.second.deferred) {
+                deferred = true;
+            } else {
+                fds.push_back({entry.first, POLLOUT, 0});
+            }
+        }
+
+        int timeout = deferred ? BROADCAST_RETRY_TIMEOUT : (queues.empty() ? -1 : BROADCAST_POLL_TIMEOUT);
+        int ret = poll(fds.data(), fds.size(), timeout);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("poll to broadcast failed %s\n", strerror(errno));
+            return;
+        }
+
+        for (size_t i = 1; i < fds.size(); ++i) {
+            if (fds[i].revents != 0) {
+                queues[fds[i].fd].ready = true;
+            }
+        }
+        for (auto &entry : queues) {
+            if (entry.second.deferred) {
+                entry.second.ready = true;
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            TakeTasks(*shard, queues);
+        }
+
+        for (auto it = queues.begin(); it != queues.end();) {
+            ConnQueue &conn = it->second;
+            if (conn.ready) {
+                conn.ready = false;
+                if (!FlushQueue(it->first, conn)) {
+                    conn.queue.clear();
+                    if (conn.sendLock.owns_lock()) {
+                        conn.sendLock.unlock();
+                    }
+                }
+            }
+            if (conn.queue.empty()) {
+                it = queues.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+static void StartShards()
+{
+    unsigned int num = std::thread::hardware_concurrency();
+    if (num == 0) {
+        num = 1;
+    }
+    for (unsigned int i = 0; i < num; ++i) {
+        int eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (eventFd < 0) {
+            printf("make broadcast eventfd failed %s\n", strerror(errno));
+            break;
+        }
+        auto shard = std::unique_ptr<BroadcastShard>(new BroadcastShard());
+        shard->eventFd = eventFd;
+        std::thread serviceThread(BroadcastLoop, shard.get());
+        serviceThread.detach();
+        g_shards.push_back(std::move(shard));
+    }
+    printf("tcp broadcast started %zu shards\n", g_shards.size());
+}
+
+SharedPayload MakeSharedPayload(std::string data)
+{
+    return std::make_shared<const std::string>(std::move(data));
+}
+
+bool ExecTcpBroadcast(const SharedPayload &payload, const std::vector<uint64_t> &handles)
+{
+    if (payload == nullptr || payload->empty()) {
+        printf("broadcast payload empty\n");
+        return false;
+    }
+    std::call_once(g_shardsOnce, StartShards);
+    if (g_shards.empty()) {
+        return false;
+    }
+
+    std::vector<std::vector<uint64_t>> split(g_shards.size());
+    ConnTable &table = GetConnTable();
+    for (uint64_t handle : handles) {
+        if (!table.IsOwnedBy(handle, ConnOwner::EXEC)) {
+            continue; /* stale, or a relay or RPC stream that broadcast bytes would corrupt */
+        }
+        split[(handle & 0xffffffffU) % g_shards.size()].push_back(handle);
+    }
+    for (size_t i = 0; i < g_shards.size(); ++i) {
+        if (split[i].empty()) {
+            continue;
+        }
+        BroadcastShard &shard = *g_shards[i];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.tasks.push_back({payload, std::move(split[i])});
+        }
+        uint64_t one = 1;
+        (void)write(shard.eventFd, &one, sizeof(one));
+    }
+    return true;
+}
+
+bool ExecTcpBroadcastAll(const SharedPayload &payload)
+{
+    std::vector<uint64_t> handles;
+    ConnTable &table = GetConnTable();
+    table.ForEach([&table, &handles](uint64_t handle, int fd) {
+        (void)fd;
+        if (table.IsOwnedBy(handle, ConnOwner::EXEC)) {
+            handles.push_back(handle);
+        }
+    });
+    return ExecTcpBroadcast(payload, handles);
+}
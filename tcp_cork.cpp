@@ -0,0 +1,423 @@
+#include "socket_exec.h"
+#include <map>
+
+static constexpr const int MAX_CORK_FD = 65536;
+
+static constexpr const int CORK_POLL_TIMEOUT = 500; // 0.5 Seconds
+
+static constexpr const uint32_t CORK_MIN_RETRY_US = 20;
+
+struct CorkState {
+    std::mutex mutex;
+    uint64_t handle;
+    size_t flushBytes;
+    uint32_t flushDelayUs;
+    int64_t deadlineNs; /* 0 while no flush deadline is armed */
+    std::string buffer;
+    std::string sending; /* a blocking flush's bytes, owned by whoever holds the send lock */
+    uint64_t flushes;
+    bool failed;   /* a flush lost data: every later write on the connection reports failure */
+    bool disabled; /* cork mode was turned off: writers that still hold the state send directly */
+};
+
+static std::shared_ptr<CorkState> g_cork[MAX_CORK_FD];
+
+struct CorkTimer {
+    int fd;
+    int64_t deadline; /* the CorkState::deadlineNs it was armed for; the key may be a later retry */
+    uint32_t retryUs;
+    std::weak_ptr<CorkState> state;
+};
+
+struct CorkTimers {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::multimap<int64_t, CorkTimer> deadlines;
+};
+
+/* never destroyed: the detached timer thread is still waiting on cond at exit */
+static CorkTimers &GetCorkTimers()
+{
+    static CorkTimers *timers = new CorkTimers();
+    return *timers;
+}
+
+static std::once_flag g_timerOnce;
+
+static int64_t MonotonicNs()
+{
+    timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000L + now.tv_nsec;
+}
+
+/* glibc's tcp_info stops at tcpi_total_retrans; the kernel only ever appends, so the tail is stable */
+struct TcpInfoExt {
+    tcp_info base;
+    uint64_t pacingRate;
+    uint64_t maxPacingRate;
+    uint64_t bytesAcked;
+    uint64_t bytesReceived;
+    uint32_t segsOut;
+    uint32_t segsIn;
+    uint32_t notsentBytes;
+    uint32_t minRtt;
+    uint32_t dataSegsIn;
+    uint32_t dataSegsOut;
+};
+
+static bool GetSegsOut(int sockfd, uint32_t *segs)
+{
+    TcpInfoExt info = {};
+    socklen_t len = sizeof(info);
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 ||
+        len < offsetof(TcpInfoExt, dataSegsOut) + sizeof(info.dataSegsOut)) {
+        return false;
+    }
+    *segs = info.dataSegsOut;
+    return true;
+}
+
+/* caller holds the connection's send lock */
+static bool SendAll(int sockfd, const char *data, size_t size, int flags)
+{
+    pollfd fds[1] = {{0}};
+    fds[0].fd = sockfd;
+    fds[0].events = POLLOUT;
+    while (size > 0) {
+        auto len = send(sockfd, data, size, flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+        GetConnTable().AddSendCalls(sockfd, 0, 1);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                printf("corked send failed %s\n", strerror(errno));
+                return false;
+            }
+            if (poll(fds, 1, CORK_POLL_TIMEOUT) <= 0) {
+                printf("poll to corked send timeout\n");
+                return false;
+            }
+            continue;
+        }
+        GetConnTable().AddSendBytes(sockfd, len);
+        data += len;
+        size -= len;
+    }
+    return true;
+}
+
+static bool LockSend(int sockfd, std::unique_lock<std::timed_mutex> *sendLock)
+{
+    if (!GetConnTable().LockSend(sockfd, sendLock, CORK_POLL_TIMEOUT)) {
+        printf("wait for send lock timeout\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * lock holds state->mutex. Sends the buffer, then data if any, and waits as long as that takes. The send
+ * lock is taken first to keep the bytes in order; state->mutex is released for the sends so the deadline
+ * timer and other writers are not held up.
+ */
+static bool FlushLocked(int sockfd, CorkState *state, std::unique_lock<std::mutex> *lock,
+                        const char *data = nullptr, size_t size = 0)
+{
+    state->deadlineNs = 0;
+    if (state->buffer.empty() && size == 0) {
+        return true;
+    }
+    std::unique_lock<std::timed_mutex> sendLock;
+    if (!LockSend(sockfd, &sendLock)) {
+        state->failed = true;
+        state->buffer.clear();
+        return false;
+    }
+    state->flushes++;
+    state->sending.swap(state->buffer);
+    lock->unlock();
+    /* MSG_MORE lets the kernel pack the buffered tail in front of data */
+    bool ok = state->sending.empty() ||
+              SendAll(sockfd, state->sending.data(), state->sending.size(), size != 0 ? MSG_MORE : 0);
+    state->sending.clear();
+    ok = ok && (size == 0 || SendAll(sockfd, data, size, 0));
+    sendLock.unlock();
+    lock->lock();
+    if (!ok) {
+        state->failed = true;
+    }
+    return ok;
+}
+
+/* state->mutex and the send lock must be held; sends what the socket takes without waiting */
+static bool SendSome(int sockfd, CorkState *state)
+{
+    size_t sent = 0;
+    bool ok = true;
+    while (sent < state->buffer.size()) {
+        auto len = send(sockfd, state->buffer.data() + sent, state->buffer.size() - sent,
+                        MSG_NOSIGNAL | MSG_DONTWAIT);
+        GetConnTable().AddSendCalls(sockfd, 0, 1);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                printf("corked send failed %s\n", strerror(errno));
+                state->failed = true;
+                ok = false;
+            }
+            break;
+        }
+        GetConnTable().AddSendBytes(sockfd, len);
+        sent += len;
+    }
+    state->buffer.erase(0, sent);
+    if (!ok) {
+        state->buffer.clear();
+    }
+    if (state->buffer.empty()) {
+        state->flushes++;
+        state->deadlineNs = 0;
+    }
+    return ok;
+}
+
+/*
+ * state->mutex must be held. Never waits, so one backpressured connection cannot hold up the deadlines
+ * of the others: what the socket does not take stays buffered. Returns the deadline to retry at, or 0.
+ */
+static int64_t TimerFlushLocked(int sockfd, CorkState *state)
+{
+    std::unique_lock<std::timed_mutex> sendLock;
+    if (GetConnTable().LockSend(sockfd, &sendLock, 0)) {
+        /* the held send lock keeps a live connection's fd from being closed and reused under the send */
+        bool live = GetConnTable().IsLive(state->handle);
+        if (live) {
+            (void)SendSome(sockfd, state);
+        }
+        if (!live || state->buffer.empty()) {
+            state->deadlineNs = 0;
+            return 0;
+        }
+    }
+    uint32_t retryUs = std::max(state->flushDelayUs, CORK_MIN_RETRY_US);
+    state->deadlineNs = MonotonicNs() + static_cast<int64_t>(retryUs) * 1000L;
+    return state->deadlineNs;
+}
+
+static void CorkTimerLoop()
+{
+    CorkTimers &timers = GetCorkTimers();
+    std::unique_lock<std::mutex> lock(timers.mutex);
+    while (true) {
+        if (timers.deadlines.empty()) {
+            timers.cond.wait(lock);
+            continue;
+        }
+        auto it = timers.deadlines.begin();
+        int64_t now = MonotonicNs();
+        if (it->first > now) {
+            timers.cond.wait_for(lock, std::chrono::nanoseconds(it->first - now));
+            continue;
+        }
+        CorkTimer timer = it->second;
+        auto state = timer.state.lock();
+        timers.deadlines.erase(it);
+        if (state == nullptr) {
+            continue;
+        }
+
+        lock.unlock();
+        int64_t retry = 0;
+        std::unique_lock<std::mutex> stateLock(state->mutex, std::try_to_lock);
+        if (!stateLock.owns_lock()) {
+            /* a writer holds it, possibly waiting for the send lock: come back rather than wait */
+            retry = MonotonicNs() + static_cast<int64_t>(timer.retryUs) * 1000L;
+        } else if (state->deadlineNs == timer.deadline) {
+            /* a size-triggered or explicit flush since arming leaves a different (or no) deadline */
+            timer.deadline = TimerFlushLocked(timer.fd, state.get());
+            timer.retryUs = std::max(state->flushDelayUs, CORK_MIN_RETRY_US);
+            retry = timer.deadline;
+        }
+        if (stateLock.owns_lock()) {
+            stateLock.unlock();
+        }
+        lock.lock();
+        if (retry != 0) {
+            timers.deadlines.emplace(retry, timer);
+        }
+    }
+}
+
+static void ArmTimer(int sockfd, const std::shared_ptr<CorkState> &state, int64_t deadline, uint32_t retryUs)
+{
+    std::call_once(g_timerOnce, [] {
+        std::thread timerThread(CorkTimerLoop);
+        timerThread.detach();
+    });
+    CorkTimers &timers = GetCorkTimers();
+    std::lock_guard<std::mutex> lock(timers.mutex);
+    bool earliest = timers.deadlines.empty() || deadline < timers.deadlines.begin()->first;
+    timers.deadlines.emplace(deadline, CorkTimer{sockfd, deadline, retryUs, state});
+    if (earliest) {
+        timers.cond.notify_one();
+    }
+}
+
+static std::shared_ptr<CorkState> GetCorkState(int sockfd)
+{
+    if (sockfd < 0 || sockfd >= MAX_CORK_FD) {
+        return nullptr;
+    }
+    auto state = std::atomic_load(&g_cork[sockfd]);
+    if (state != nullptr && !GetConnTable().IsLive(state->handle)) {
+        /* left behind by a closed connection whose fd number has been reused */
+        std::atomic_compare_exchange_strong(&g_cork[sockfd], &state, std::shared_ptr<CorkState>());
+        return nullptr;
+    }
+    return state;
+}
+
+bool ExecTcpSetCork(int sockfd, size_t flushBytes, uint32_t flushDelayUs)
+{
+    if (sockfd < 0 || sockfd >= MAX_CORK_FD) {
+        return false;
+    }
+    uint64_t handle = GetConnTable().GetHandle(sockfd);
+    if (handle == ConnTable::INVALID_HANDLE) {
+        printf("cork needs a connected socket\n");
+        return false;
+    }
+
+    auto state = GetCorkState(sockfd);
+    if (flushBytes == 0) {
+        if (state == nullptr) {
+            return true;
+        }
+        std::atomic_store(&g_cork[sockfd], std::shared_ptr<CorkState>());
+        /* a writer that loaded the state before the store must not append behind the final flush */
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->disabled = true;
+        return FlushLocked(sockfd, state.get(), &lock) && !state->failed;
+    }
+    if (state != nullptr) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->flushBytes = flushBytes;
+        state->flushDelayUs = flushDelayUs;
+        return true;
+    }
+
+    state = std::make_shared<CorkState>();
+    state->handle = handle;
+    state->flushBytes = flushBytes;
+    state->flushDelayUs = flushDelayUs;
+    state->deadlineNs = 0;
+    state->flushes = 0;
+    state->failed = false;
+    state->disabled = false;
+    state->buffer.reserve(flushBytes);
+    std::atomic_store(&g_cork[sockfd], state);
+    return true;
+}
+
+bool ExecTcpFlush(int sockfd)
+{
+    auto state = GetCorkState(sockfd);
+    if (state == nullptr) {
+        return true;
+    }
+    std::unique_lock<std::mutex> lock(state->mutex);
+    return FlushLocked(sockfd, state.get(), &lock) && !state->failed;
+}
+
+bool TcpCorkWrite(int sockfd, const char *data, size_t size, bool *sent)
+{
+    auto state = GetCorkState(sockfd);
+    if (state == nullptr) {
+        return false;
+    }
+
+    int64_t armDeadline = 0;
+    uint32_t retryUs = 0;
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (state->disabled) {
+            /* the final flush took the send lock before releasing state->mutex, so a direct send follows it */
+            return false;
+        }
+        if (state->failed) {
+            printf("corked connection %d lost data in an earlier flush\n", sockfd);
+            *sent = false;
+            return true;
+        }
+        if (size >= state->flushBytes) {
+            /* too big to be worth copying: sent straight after the buffered tail */
+            *sent = FlushLocked(sockfd, state.get(), &lock, data, size);
+            return true;
+        }
+        state->buffer.append(data, size);
+        if (state->buffer.size() >= state->flushBytes) {
+            *sent = FlushLocked(sockfd, state.get(), &lock);
+            return true;
+        }
+        if (state->deadlineNs == 0 && state->flushDelayUs != 0) {
+            state->deadlineNs = MonotonicNs() + static_cast<int64_t>(state->flushDelayUs) * 1000L;
+            armDeadline = state->deadlineNs;
+            retryUs = std::max(state->flushDelayUs, CORK_MIN_RETRY_US);
+        }
+    }
+    if (armDeadline != 0) {
+        ArmTimer(sockfd, state, armDeadline, retryUs);
+    }
+    *sent = true;
+    return true;
+}
+
+bool TcpCorkDrain(int sockfd)
+{
+    auto state = GetCorkState(sockfd);
+    if (state == nullptr) {
+        return true;
+    }
+    std::unique_lock<std::mutex> lock(state->mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return false;
+    }
+    if (state->buffer.empty()) {
+        return true;
+    }
+    std::unique_lock<std::timed_mutex> sendLock;
+    if (!GetConnTable().LockSend(sockfd, &sendLock, 0)) {
+        return false;
+    }
+    return SendSome(sockfd, state.get()) && state->buffer.empty();
+}
+
+void DumpTcpWriteStats(int sockfd)
+{
+    ConnTable &table = GetConnTable();
+    uint64_t handle = table.GetHandle(sockfd);
+    if (handle == ConnTable::INVALID_HANDLE) {
+        printf("sock %d is not tracked\n", sockfd);
+        return;
+    }
+    uint64_t messages = table.GetSendMessages(handle);
+    uint64_t syscalls = table.GetSendSyscalls(handle);
+    double perMessage = messages == 0 ? 0.0 : 1.0 / messages;
+    printf("sock %d: %lu messages, %lu send syscalls (%.3f per message)", sockfd, messages, syscalls,
+           syscalls * perMessage);
+    /* counted by the kernel since the socket was created, retransmits included */
+    uint32_t segs = 0;
+    if (GetSegsOut(sockfd, &segs)) {
+        printf(", %u segments (%.3f per message)", segs, segs * perMessage);
+    } else {
+        printf(", segments n/a");
+    }
+    auto state = GetCorkState(sockfd);
+    if (state != nullptr) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        printf(", corked: %lu flushes, %zu bytes buffered%s", state->flushes, state->buffer.size(),
+               state->failed ? ", lost data" : "");
+    }
+    printf("\n");
+}
@@ -0,0 +1,251 @@
+#include "socket_exec.h"
+#include <mutex>
+#include <vector>
+
+static constexpr const int RELAY_POLL_TIMEOUT = 500; // 0.5 Seconds
+
+static constexpr const int RELAY_PIPE_SIZE = 1024 * 1024;
+
+struct RelayInfo {
+    uint64_t clientHandle;
+    uint64_t backendHandle;
+    std::atomic<uint64_t> upBytes;   /* client to backend */
+    std::atomic<uint64_t> downBytes; /* backend to client */
+};
+
+/* one direction of a relay: from -> pipe -> to */
+struct RelayDirection {
+    int from;
+    int to;
+    int pipeFds[2];
+    size_t pipeSize;
+    size_t pending;  /* bytes sitting in the pipe */
+    bool readClosed; /* from has sent FIN */
+    bool writeShut;  /* FIN has been forwarded to to */
+    std::atomic<uint64_t> *bytes;
+};
+
+static std::mutex g_relayMutex;
+
+static std::list<std::shared_ptr<RelayInfo>> g_relays;
+
+static bool OpenRelayPipe(RelayDirection *dir)
+{
+    if (pipe2(dir->pipeFds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        printf("make relay pipe failed %s\n", strerror(errno));
+        return false;
+    }
+    int size = fcntl(dir->pipeFds[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    if (size < 0) {
+        size = fcntl(dir->pipeFds[1], F_GETPIPE_SZ);
+    }
+    dir->pipeSize = size > 0 ? static_cast<size_t>(size) : 65536;
+    return true;
+}
+
+static void CloseRelayPipe(RelayDirection *dir)
+{
+    close(dir->pipeFds[0]);
+    close(dir->pipeFds[1]);
+}
+
+/* moves what it can without blocking; returns false on a hard error */
+static bool PumpRelay(RelayDirection *dir)
+{
+    while (true) {
+        bool progress = false;
+        if (!dir->readClosed && dir->pending < dir->pipeSize) {
+            auto len = splice(dir->from, nullptr, dir->pipeFds[1], nullptr, dir->pipeSize - dir->pending,
+                              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (len > 0) {
+                dir->pending += len;
+                progress = true;
+            } else if (len == 0) {
+                dir->readClosed = true;
+            } else if (errno != EAGAIN && errno != EINTR) {
+                printf("relay splice from %d failed %s\n", dir->from, strerror(errno));
+                return false;
+            }
+        }
+        if (dir->pending > 0) {
+            auto len = splice(dir->pipeFds[0], nullptr, dir->to, nullptr, dir->pending,
+                              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (len > 0) {
+                dir->pending -= len;
+                dir->bytes->fetch_add(len, std::memory_order_relaxed);
+                GetConnTable().AddRecvBytes(dir->from, len);
+                GetConnTable().AddSendBytes(dir->to, len);
+                progress = true;
+            } else if (len < 0 && errno != EAGAIN && errno != EINTR) {
+                printf("relay splice to %d failed %s\n", dir->to, strerror(errno));
+                return false;
+            }
+        }
+        if (!progress) {
+            break;
+        }
+    }
+
+    /* half-close: forward the FIN only once everything before it has been written */
+    if (dir->readClosed && dir->pending == 0 && !dir->writeShut) {
+        (void)shutdown(dir->to, SHUT_WR);
+        dir->writeShut = true;
+    }
+    return true;
+}
+
+static void StopRelayDirection(RelayDirection *dir)
+{
+    dir->readClosed = true;
+    dir->writeShut = true;
+    dir->pending = 0;
+}
+
+static short RelayEvents(const RelayDirection &readDir, const RelayDirection &writeDir)
+{
+    short events = 0;
+    if (!readDir.readClosed && readDir.pending < readDir.pipeSize) {
+        events |= POLLIN;
+    }
+    if (writeDir.pending > 0) {
+        events |= POLLOUT;
+    }
+    return events;
+}
+
+static void RelayLoop(int client, int backend, std::shared_ptr<RelayInfo> info)
+{
+    RelayDirection up = {client, backend, {-1, -1}, 0, 0, false, false, &info->upBytes};
+    RelayDirection down = {backend, client, {-1, -1}, 0, 0, false, false, &info->downBytes};
+    if (OpenRelayPipe(&up)) {
+        if (OpenRelayPipe(&down)) {
+            pollfd fds[2] = {{0}};
+            bool hungUp[2] = {false, false};
+            while (!(up.writeShut && down.writeShut)) {
+                fds[0].events = RelayEvents(up, down);
+                fds[1].events = RelayEvents(down, up);
+                /* POLLHUP is level-triggered: a hung-up side with nothing left to read would wake every poll */
+                fds[0].fd = (hungUp[0] && fds[0].events == 0) ? -1 : client;
+                fds[1].fd = (hungUp[1] && fds[1].events == 0) ? -1 : backend;
+                int ret = poll(fds, 2, RELAY_POLL_TIMEOUT);
+                if (ret < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    printf("poll to relay failed %s\n", strerror(errno));
+                    break;
+                }
+                if (ret == 0) {
+                    continue;
+                }
+                if ((fds[0].revents | fds[1].revents) & POLLERR) {
+                    printf("relay %d <-> %d socket error\n", client, backend);
+                    break;
+                }
+                /* a fully closed peer can take nothing more: stop feeding it, keep draining what it sent */
+                if (fds[0].revents & POLLHUP) {
+                    StopRelayDirection(&down);
+                    hungUp[0] = true;
+                }
+                if (fds[1].revents & POLLHUP) {
+                    StopRelayDirection(&up);
+                    hungUp[1] = true;
+                }
+                if (!PumpRelay(&up) || !PumpRelay(&down)) {
+                    break;
+                }
+            }
+            CloseRelayPipe(&down);
+        }
+        CloseRelayPipe(&up);
+    }
+
+    printf("relay %d <-> %d done, up %lu bytes, down %lu bytes\n", client, backend, info->upBytes.load(),
+           info->downBytes.load());
+    {
+        std::lock_guard<std::mutex> lock(g_relayMutex);
+        g_relays.remove(info);
+    }
+    if (!GetConnTable().Close(info->clientHandle)) {
+        close(client);
+    }
+    if (!GetConnTable().Close(info->backendHandle)) {
+        close(backend);
+    }
+}
+
+static void StartRelay(int client, sockaddr_storage peer, socklen_t peerLen, NetAddress backendAddr,
+                       uint32_t timeoutSec)
+{
+    int backend = MakeTcpSocket(backendAddr.GetSaFamily());
+    if (backend < 0) {
+        close(client);
+        return;
+    }
+    if (!ExecConnectOnly(backend, &backendAddr, timeoutSec)) {
+        close(backend);
+        close(client);
+        return;
+    }
+
+    auto info = std::make_shared<RelayInfo>();
+    info->clientHandle = GetConnTable().Add(client, reinterpret_cast<sockaddr *>(&peer), peerLen, ConnOwner::RELAY);
+    info->backendHandle = GetConnTable().GetHandle(backend);
+    GetConnTable().SetOwner(info->backendHandle, ConnOwner::RELAY);
+    info->upBytes = 0;
+    info->downBytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_relayMutex);
+        g_relays.push_back(info);
+    }
+    RelayLoop(client, backend, info);
+}
+
+static void RelayListenConn(int socketFd, NetAddress backendAddr, uint32_t timeoutSec)
+{
+    while (true) {
+        sockaddr_storage peer = {0};
+        socklen_t peerLen = sizeof(peer);
+        int connfd = accept4(socketFd, reinterpret_cast<sockaddr *>(&peer), &peerLen, SOCK_NONBLOCK);
+        if (connfd == -1) {
+            if (errno == EWOULDBLOCK) {
+                sleep(1);
+                continue;
+            }
+            printf("error when accepting relay connection errno %d %s\n", errno, strerror(errno));
+            return;
+        }
+        printf("accept new relay connfd is %d\n", connfd);
+        /* the backend connect may block up to timeoutSec, so it runs on the relay's own thread */
+        std::thread serviceThread(StartRelay, connfd, peer, peerLen, backendAddr, timeoutSec);
+        serviceThread.detach();
+    }
+}
+
+bool ExecTcpRelayListen(int sockfd, NetAddress *backend, uint32_t timeoutSec)
+{
+    printf("tcp relay start listen.\n");
+    if (listen(sockfd, 10) < 0) {
+        printf("listen errno %d %s\n", errno, strerror(errno));
+        return false;
+    }
+
+    std::thread serviceThread(RelayListenConn, sockfd, *backend, timeoutSec);
+    serviceThread.detach();
+    return true;
+}
+
+void DumpRelayStats()
+{
+    timespec now = {0};
+    clock_gettime(CLOCK_REALTIME, &now);
+    std::lock_guard<std::mutex> lock(g_relayMutex);
+    printf("%zu relays\n", g_relays.size());
+    for (auto &info : g_relays) {
+        timespec since = now;
+        (void)GetConnTable().GetSince(info->clientHandle, &since);
+        printf("  relay fd %d <-> fd %d: up %lu bytes, down %lu bytes, up for %ld s\n",
+               GetConnTable().GetFd(info->clientHandle), GetConnTable().GetFd(info->backendHandle),
+               info->upBytes.load(), info->downBytes.load(), static_cast<long>(now.tv_sec - since.tv_sec));
+    }
+}
@@ -0,0 +1,275 @@
+#include "traffic_capture.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static constexpr const uint64_t CAPTURE_ALIGN = 8;
+
+static constexpr const uint64_t CAPTURE_PAGE = 4096;
+
+struct CaptureState {
+    int fd;
+    char *base;
+    size_t mapSize;
+    CaptureFileHeader *header;
+    CaptureIndexEntry *index;
+    char *data;
+    std::atomic<uint64_t> tail;
+};
+
+static std::atomic<CaptureState *> g_capture(nullptr);
+
+/*
+ * Writers in flight, counted outside CaptureState so the count outlives it. Writers register in the
+ * slot of the current epoch; StopCapture bumps the epoch and drains the old slot, so a steady stream
+ * of new writers cannot keep it waiting.
+ */
+static std::atomic<uint64_t> g_captureEpoch(0);
+
+static std::atomic<uint32_t> g_captureWriters[2];
+
+static std::atomic<uint64_t> g_captureDropped(0);
+
+static uint64_t AlignUp(uint64_t value, uint64_t align)
+{
+    return (value + align - 1) / align * align;
+}
+
+bool StartCapture(const std::string &path, uint64_t capacity)
+{
+    if (g_capture.load() != nullptr) {
+        printf("capture already started\n");
+        return false;
+    }
+    capacity = AlignUp(capacity, CAPTURE_PAGE);
+    uint64_t indexOffset = AlignUp(sizeof(CaptureFileHeader), 64);
+    uint64_t indexCount = capacity / CAPTURE_INDEX_STRIDE + 1;
+    uint64_t dataOffset = AlignUp(indexOffset + indexCount * sizeof(CaptureIndexEntry), CAPTURE_PAGE);
+    size_t mapSize = dataOffset + capacity;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        printf("open capture file %s failed %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    /* reserve the blocks up front: running out of disk under a shared mapping raises SIGBUS */
+    int ret = posix_fallocate(fd, 0, mapSize);
+    if (ret != 0) {
+        printf("allocate capture file failed %s\n", strerror(ret));
+        close(fd);
+        return false;
+    }
+    void *base = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        printf("map capture file failed %s\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    auto state = new CaptureState();
+    state->fd = fd;
+    state->base = reinterpret_cast<char *>(base);
+    state->mapSize = mapSize;
+    state->header = reinterpret_cast<CaptureFileHeader *>(state->base);
+    state->index = reinterpret_cast<CaptureIndexEntry *>(state->base + indexOffset);
+    state->data = state->base + dataOffset;
+    state->tail = 0;
+    state->header->capacity = capacity;
+    state->header->indexOffset = indexOffset;
+    state->header->indexCount = indexCount;
+    state->header->dataOffset = dataOffset;
+    __atomic_store_n(&state->header->magic, CAPTURE_MAGIC, __ATOMIC_RELEASE);
+
+    g_captureDropped = 0;
+    g_capture.store(state, std::memory_order_release);
+    printf("capture started %s, %lu bytes\n", path.c_str(), capacity);
+    return true;
+}
+
+void StopCapture()
+{
+    CaptureState *state = g_capture.exchange(nullptr);
+    if (state == nullptr) {
+        return;
+    }
+    /* any writer that can still hold state registered before the epoch moves on */
+    uint64_t epoch = g_captureEpoch.fetch_add(1);
+    while (g_captureWriters[epoch & 1].load() != 0) {
+        std::this_thread::yield();
+    }
+    uint64_t used = std::min(state->tail.load(), state->header->capacity);
+    (void)msync(state->base, state->mapSize, MS_SYNC);
+    (void)munmap(state->base, state->mapSize);
+    close(state->fd);
+    printf("capture stopped, %lu bytes, %lu dropped\n", used, g_captureDropped.load());
+    delete state;
+}
+
+bool IsCaptureEnabled()
+{
+    return g_capture.load(std::memory_order_relaxed) != nullptr;
+}
+
+uint64_t GetCaptureDropped()
+{
+    return g_captureDropped.load(std::memory_order_relaxed);
+}
+
+static void FillRecordAddress(const sockaddr *remote, CaptureRecordHeader *record)
+{
+    if (remote == nullptr) {
+        return;
+    }
+    record->family = remote->sa_family;
+    if (remote->sa_family == AF_INET) {
+        auto *addr4 = reinterpret_cast<const sockaddr_in *>(remote);
+        record->port = ntohs(addr4->sin_port);
+        (void)memcpy(record->address, &addr4->sin_addr, sizeof(addr4->sin_addr));
+    } else if (remote->sa_family == AF_INET6) {
+        auto *addr6 = reinterpret_cast<const sockaddr_in6 *>(remote);
+        record->port = ntohs(addr6->sin6_port);
+        (void)memcpy(record->address, &addr6->sin6_addr, sizeof(addr6->sin6_addr));
+    } else if (remote->sa_family == AF_UNIX) {
+        auto *addrUn = reinterpret_cast<const sockaddr_un *>(remote);
+        (void)memcpy(record->address, addrUn->sun_path, sizeof(record->address));
+    }
+}
+
+void CaptureMessage(bool isTcp, uint64_t connId, const sockaddr *remote, const void *data, size_t len,
+                    const timespec &when)
+{
+    if (g_capture.load(std::memory_order_relaxed) == nullptr) {
+        return;
+    }
+    /* register before loading the state: StopCapture frees it only after draining this slot */
+    uint64_t epoch = g_captureEpoch.load();
+    while (true) {
+        g_captureWriters[epoch & 1].fetch_add(1);
+        uint64_t current = g_captureEpoch.load();
+        if (current == epoch) {
+            break;
+        }
+        g_captureWriters[epoch & 1].fetch_sub(1);
+        epoch = current;
+    }
+    std::atomic<uint32_t> &writers = g_captureWriters[epoch & 1];
+    CaptureState *state = g_capture.load();
+    if (state == nullptr) {
+        writers.fetch_sub(1);
+        return;
+    }
+
+    uint64_t recordLen = AlignUp(sizeof(CaptureRecordHeader) + len, CAPTURE_ALIGN);
+    uint64_t offset = state->tail.fetch_add(recordLen, std::memory_order_relaxed);
+    if (offset + recordLen > state->header->capacity || recordLen > UINT32_MAX) {
+        g_captureDropped.fetch_add(1, std::memory_order_relaxed);
+        writers.fetch_sub(1);
+        return;
+    }
+
+    CaptureRecordHeader record = {0};
+    record.payloadLen = static_cast<uint32_t>(len);
+    record.timestampNs = static_cast<int64_t>(when.tv_sec) * 1000000000L + when.tv_nsec;
+    record.isTcp = isTcp ? 1 : 0;
+    record.connId = connId;
+    FillRecordAddress(remote, &record);
+
+    char *dst = state->data + offset;
+    (void)memcpy(dst + sizeof(record.length), reinterpret_cast<char *>(&record) + sizeof(record.length),
+                 sizeof(record) - sizeof(record.length));
+    (void)memcpy(dst + sizeof(record), data, len);
+
+    /* the record holding a stride boundary indexes that stride, so each entry has a single writer */
+    uint64_t stride = AlignUp(offset, CAPTURE_INDEX_STRIDE) / CAPTURE_INDEX_STRIDE;
+    if (stride * CAPTURE_INDEX_STRIDE < offset + recordLen) {
+        state->index[stride].offset = offset;
+        __atomic_store_n(&state->index[stride].timestampNs, record.timestampNs, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(reinterpret_cast<uint32_t *>(dst), static_cast<uint32_t>(recordLen), __ATOMIC_RELEASE);
+    writers.fetch_sub(1);
+}
+
+CaptureReader::CaptureReader() : base_(nullptr), size_(0), header_(nullptr), cursor_(0) {}
+
+CaptureReader::~CaptureReader()
+{
+    if (base_ != nullptr) {
+        (void)munmap(const_cast<char *>(base_), size_);
+    }
+}
+
+bool CaptureReader::Open(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        printf("open capture file %s failed %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st = {0};
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(CaptureFileHeader)) {
+        printf("capture file %s too small\n", path.c_str());
+        close(fd);
+        return false;
+    }
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("map capture file failed %s\n", strerror(errno));
+        return false;
+    }
+    base_ = reinterpret_cast<const char *>(base);
+    size_ = st.st_size;
+    header_ = reinterpret_cast<const CaptureFileHeader *>(base_);
+    if (header_->magic != CAPTURE_MAGIC || header_->dataOffset + header_->capacity > size_) {
+        printf("capture file %s is not a capture\n", path.c_str());
+        return false;
+    }
+    (void)madvise(base, size_, MADV_SEQUENTIAL);
+    cursor_ = 0;
+    return true;
+}
+
+bool CaptureReader::Seek(int64_t timestampNs)
+{
+    if (header_ == nullptr) {
+        return false;
+    }
+    auto index = reinterpret_cast<const CaptureIndexEntry *>(base_ + header_->indexOffset);
+    cursor_ = 0;
+    for (uint64_t i = 0; i < header_->indexCount; ++i) {
+        int64_t entryTs = __atomic_load_n(&index[i].timestampNs, __ATOMIC_ACQUIRE);
+        if (entryTs == 0 || entryTs > timestampNs) {
+            break;
+        }
+        cursor_ = index[i].offset;
+    }
+
+    while (true) {
+        uint64_t start = cursor_;
+        CaptureRecordHeader header;
+        const char *payload = nullptr;
+        if (!Next(&header, &payload)) {
+            return false;
+        }
+        if (header.timestampNs >= timestampNs) {
+            cursor_ = start;
+            return true;
+        }
+    }
+}
+
+bool CaptureReader::Next(CaptureRecordHeader *header, const char **payload)
+{
+    if (header_ == nullptr || cursor_ + sizeof(CaptureRecordHeader) > header_->capacity) {
+        return false;
+    }
+    const char *src = base_ + header_->dataOffset + cursor_;
+    uint32_t length = __atomic_load_n(reinterpret_cast<const uint32_t *>(src), __ATOMIC_ACQUIRE);
+    if (length == 0 || cursor_ + length > header_->capacity) {
+        return false;
+    }
+    (void)memcpy(header, src, sizeof(CaptureRecordHeader));
+    *payload = src + sizeof(CaptureRecordHeader);
+    cursor_ += length;
+    return true;
+}
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <map>
+#include "socket_exec.h"
+
+static int64_t MonotonicNs()
+{
+    timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000L + now.tv_nsec;
+}
+
+static void SleepUntil(int64_t targetNs)
+{
+    int64_t left = targetNs - MonotonicNs();
+    if (left > 0) {
+        timespec ts = {static_cast<time_t>(left / 1000000000L), static_cast<long>(left % 1000000000L)};
+        (void)nanosleep(&ts, nullptr);
+    }
+}
+
+/* one replay socket per captured peer; TCP records carry their connection so reconnects stay apart */
+static std::string RecordPeerKey(const CaptureRecordHeader &record)
+{
+    std::string key(1, record.isTcp ? 't' : 'u');
+    if (record.isTcp && record.connId != 0) {
+        key.append(reinterpret_cast<const char *>(&record.connId), sizeof(record.connId));
+        return key;
+    }
+    key.append(reinterpret_cast<const char *>(&record.family), sizeof(record.family));
+    key.append(reinterpret_cast<const char *>(&record.port), sizeof(record.port));
+    key.append(reinterpret_cast<const char *>(record.address), sizeof(record.address));
+    return key;
+}
+
+static int GetReplaySocket(std::map<std::string, int> &socks, const CaptureRecordHeader &record,
+                           NetAddress *target)
+{
+    std::string key = RecordPeerKey(record);
+    auto it = socks.find(key);
+    if (it != socks.end()) {
+        return it->second;
+    }
+    int sock = -1;
+    if (record.isTcp) {
+        sock = MakeTcpSocket(target->GetSaFamily());
+        if (sock >= 0 && !ExecConnectOnly(sock, target, 10)) {
+            close(sock);
+            sock = -1;
+        }
+    } else {
+        sock = MakeUdpSocket(target->GetSaFamily());
+    }
+    if (sock >= 0) {
+        socks.emplace(key, sock);
+    }
+    return sock;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4) {
+        printf("usage: traffic_replay <capture file> <ip> <port> [timed|fast] [start timestamp ns]\n");
+        return 0;
+    }
+
+    std::string path(argv[1]);
+    std::string ip(argv[2]);
+    uint16_t port = atoi(argv[3]);
+    bool timed = (argc < 5 || strcmp(argv[4], "fast") != 0);
+
+    CaptureReader reader;
+    if (!reader.Open(path)) {
+        return 1;
+    }
+    if (argc >= 6 && !reader.Seek(strtoll(argv[5], nullptr, 10))) {
+        printf("nothing captured after %s\n", argv[5]);
+        return 0;
+    }
+
+    NetAddress target;
+    target.SetAddress(ip);
+    target.SetPort(port);
+    if (ip.find(':') != std::string::npos) {
+        target.SetFamilyBySaFamily(AF_INET6);
+    } else if (!ip.empty() && (ip[0] == '/' || ip[0] == '@')) {
+        target.SetFamilyBySaFamily(AF_UNIX);
+    }
+
+    std::map<std::string, int> socks;
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    int64_t firstCaptureNs = 0;
+    int64_t startNs = MonotonicNs();
+
+    CaptureRecordHeader record;
+    const char *payload = nullptr;
+    while (reader.Next(&record, &payload)) {
+        if (count == 0) {
+            firstCaptureNs = record.timestampNs;
+        }
+        if (timed) {
+            SleepUntil(startNs + (record.timestampNs - firstCaptureNs));
+        }
+
+        std::string data(payload, record.payloadLen);
+        int sock = GetReplaySocket(socks, record, &target);
+        if (sock < 0) {
+            return 1;
+        }
+        bool ok = false;
+        if (record.isTcp) {
+            ok = ExecTcpSend(sock, std::move(data), record.payloadLen);
+        } else {
+            ok = ExecUdpSend(sock, &target, std::move(data), record.payloadLen);
+        }
+        if (!ok) {
+            printf("replay stopped at record %lu\n", count);
+            break;
+        }
+        count++;
+        bytes += record.payloadLen;
+    }
+
+    double seconds = (MonotonicNs() - startNs) / 1e9;
+    printf("replayed %lu messages, %lu bytes from %zu peers in %.3f s\n", count, bytes, socks.size(), seconds);
+
+    for (auto &entry : socks) {
+        close(entry.second);
+    }
+    return 0;
+}
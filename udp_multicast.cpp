@@ -0,0 +1,172 @@
+#include "udp_multicast.h"
+#include <endian.h>
+#include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+/* how far behind the newest sequence a late datagram can still be matched to its gap */
+static constexpr const uint64_t MULTICAST_REORDER_WINDOW = 1024;
+
+static constexpr const int MAX_PUBLISH_FD = 65536;
+
+struct MulticastSenderSeq {
+    uint64_t last;
+    std::set<uint64_t> missing; /* gaps within MULTICAST_REORDER_WINDOW of last */
+};
+
+struct MulticastGroupStats {
+    uint64_t received;
+    uint64_t bytes;
+    uint64_t lost;       /* gaps not filled (yet) */
+    uint64_t late;       /* reordered: arrived after a newer sequence and filled its gap */
+    uint64_t duplicated;
+    uint64_t senders;
+};
+
+struct MulticastStreamKey {
+    MulticastAddr group;
+    MulticastAddr sender;
+
+    bool operator==(const MulticastStreamKey &other) const
+    {
+        return group == other.group && sender == other.sender;
+    }
+};
+
+struct MulticastAddrHash {
+    size_t operator()(const MulticastAddr &addr) const
+    {
+        uint64_t h = addr.words[0] * 0x9e3779b97f4a7c15ULL ^ addr.words[1];
+        h ^= static_cast<uint64_t>(addr.port) << 16 | addr.family;
+        return static_cast<size_t>(h * 0xff51afd7ed558ccdULL);
+    }
+
+    size_t operator()(const MulticastStreamKey &key) const
+    {
+        return (*this)(key.group) * 31 + (*this)(key.sender);
+    }
+};
+
+/* the mutex is taken once per datagram by the owning receive thread and only contended by a dump */
+struct MulticastSocketStats {
+    int sock;
+    std::mutex mutex;
+    std::unordered_map<MulticastAddr, MulticastGroupStats, MulticastAddrHash> groups;
+    std::unordered_map<MulticastStreamKey, MulticastSenderSeq, MulticastAddrHash> streams;
+};
+
+static std::mutex g_statsMutex;
+
+static std::vector<std::shared_ptr<MulticastSocketStats>> g_socketStats;
+
+static std::atomic<uint64_t> g_publishSeq[MAX_PUBLISH_FD];
+
+static std::atomic<uint64_t> g_publishSeqShared(0); /* fds past MAX_PUBLISH_FD */
+
+static void MakeSenderAddr(const sockaddr *sender, MulticastAddr *addr)
+{
+    *addr = {};
+    addr->family = sender->sa_family;
+    if (sender->sa_family == AF_INET) {
+        auto *addr4 = reinterpret_cast<const sockaddr_in *>(sender);
+        (void)memcpy(addr->words, &addr4->sin_addr, sizeof(addr4->sin_addr));
+        addr->port = addr4->sin_port;
+    } else if (sender->sa_family == AF_INET6) {
+        auto *addr6 = reinterpret_cast<const sockaddr_in6 *>(sender);
+        (void)memcpy(addr->words, &addr6->sin6_addr, sizeof(addr6->sin6_addr));
+        addr->port = addr6->sin6_port;
+    }
+}
+
+void MakeMulticastHeader(int sock, MulticastHeader *header)
+{
+    std::atomic<uint64_t> &counter = sock >= 0 && sock < MAX_PUBLISH_FD ? g_publishSeq[sock] : g_publishSeqShared;
+    uint64_t seq = counter.fetch_add(1, std::memory_order_relaxed) + 1;
+    header->magic = htonl(MULTICAST_MAGIC);
+    header->reserved = 0;
+    header->seq = htobe64(seq);
+}
+
+std::shared_ptr<MulticastSocketStats> AttachMulticastStats(int sock)
+{
+    auto stats = std::make_shared<MulticastSocketStats>();
+    stats->sock = sock;
+    std::lock_guard<std::mutex> lock(g_statsMutex);
+    g_socketStats.push_back(stats);
+    return stats;
+}
+
+size_t OnMulticastMessage(MulticastSocketStats *stats, const MulticastAddr &group, const sockaddr *sender,
+                          const char *data, size_t len)
+{
+    bool sequenced = false;
+    uint64_t seq = 0;
+    if (len >= sizeof(MulticastHeader)) {
+        auto *header = reinterpret_cast<const MulticastHeader *>(data);
+        if (ntohl(header->magic) == MULTICAST_MAGIC) {
+            sequenced = true;
+            seq = be64toh(header->seq);
+        }
+    }
+    size_t headerLen = sequenced ? sizeof(MulticastHeader) : 0;
+
+    std::lock_guard<std::mutex> lock(stats->mutex);
+    MulticastGroupStats &groupStats = stats->groups[group];
+    groupStats.received++;
+    groupStats.bytes += len - headerLen;
+    if (!sequenced) {
+        return headerLen;
+    }
+    MulticastStreamKey key = {group, {}};
+    MakeSenderAddr(sender, &key.sender);
+    auto it = stats->streams.find(key);
+    if (it == stats->streams.end()) {
+        stats->streams[key].last = seq;
+        groupStats.senders++;
+    } else if (seq > it->second.last) {
+        MulticastSenderSeq &stream = it->second;
+        groupStats.lost += seq - stream.last - 1;
+        uint64_t windowStart = seq > MULTICAST_REORDER_WINDOW ? seq - MULTICAST_REORDER_WINDOW : 0;
+        for (uint64_t gap = std::max(stream.last + 1, windowStart); gap < seq; ++gap) {
+            stream.missing.insert(gap);
+        }
+        stream.missing.erase(stream.missing.begin(), stream.missing.lower_bound(windowStart));
+        stream.last = seq;
+    } else if (it->second.missing.erase(seq) != 0) {
+        groupStats.lost--;
+        groupStats.late++;
+    } else {
+        groupStats.duplicated++;
+    }
+    return headerLen;
+}
+
+void DumpMulticastStats()
+{
+    std::map<std::string, MulticastGroupStats> totals;
+    {
+        std::lock_guard<std::mutex> lock(g_statsMutex);
+        for (auto &stats : g_socketStats) {
+            std::lock_guard<std::mutex> statsLock(stats->mutex);
+            for (auto &entry : stats->groups) {
+                char str[INET6_ADDRSTRLEN] = {0};
+                (void)inet_ntop(entry.first.family, entry.first.words, str, sizeof(str));
+                MulticastGroupStats &total = totals[str];
+                total.received += entry.second.received;
+                total.bytes += entry.second.bytes;
+                total.lost += entry.second.lost;
+                total.late += entry.second.late;
+                total.duplicated += entry.second.duplicated;
+                total.senders += entry.second.senders;
+            }
+        }
+    }
+    for (auto &entry : totals) {
+        const MulticastGroupStats &stats = entry.second;
+        printf("group %s: received %lu, bytes %lu, lost %lu, late %lu, duplicated %lu, streams %lu\n",
+               entry.first.c_str(), stats.received, stats.bytes, stats.lost, stats.late, stats.duplicated,
+               stats.senders);
+    }
+}